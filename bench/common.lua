@@ -0,0 +1,96 @@
+local table = require "table"
+
+local odbx = require "odbxuv"
+
+local now = odbx.now
+
+-- Shared setup and reporting for the benchmarks. Results are printed as tab separated
+-- "benchmark<TAB>metric<TAB>value" lines in a fixed order so two runs can be diffed
+
+local common = {}
+
+common.now = now
+
+common.CREDENTIALS = {
+    type        = "sqlite3",
+    host        = "localhost",
+    port        = nil,
+    database    = process.env.BENCH_DATABASE or "bench",
+    username    = "test",
+    password    = "test"
+}
+
+function common.report(benchmark, metric, value)
+    print(string.format("%s\t%s\t%.6g", benchmark, metric, value))
+end
+
+-- Reports mean, p50, p99 and max of the samples (ms) as microseconds
+function common.reportLatency(benchmark, samples)
+    table.sort(samples)
+
+    local sum = 0
+    for _, sample in ipairs(samples) do
+        sum = sum + sample
+    end
+
+    local function percentile(p)
+        return samples[math.max(1, math.ceil(#samples * p))] * 1000
+    end
+
+    common.report(benchmark, "calls", #samples)
+    common.report(benchmark, "mean_us", sum / #samples * 1000)
+    common.report(benchmark, "p50_us", percentile(0.5))
+    common.report(benchmark, "p99_us", percentile(0.99))
+    common.report(benchmark, "max_us", samples[#samples] * 1000)
+end
+
+-- Counts full garbage collection cycles with a sentinel that re-arms itself when collected
+function common.gcCounter()
+    local counter = {cycles = 0}
+
+    local function arm()
+        local sentinel = newproxy(true)
+        getmetatable(sentinel).__gc = function()
+            if not counter.stopped then
+                counter.cycles = counter.cycles + 1
+                arm()
+            end
+        end
+    end
+    arm()
+
+    function counter:stop()
+        self.stopped = true
+        return self.cycles
+    end
+
+    return counter
+end
+
+-- Runs fn(done) with the collector stopped and calls callback(kilobytes) with what it allocated
+function common.measureAllocation(fn, callback)
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local before = collectgarbage("count")
+
+    fn(function()
+        local allocated = collectgarbage("count") - before
+        collectgarbage("restart")
+        callback(allocated)
+    end)
+end
+
+-- Runs the steps one after another, each is called as step(next)
+function common.sequence(steps, callback)
+    local i = 0
+    local function nextStep()
+        i = i + 1
+        if not steps[i] then
+            return callback and callback()
+        end
+        steps[i](nextStep)
+    end
+    nextStep()
+end
+
+return common
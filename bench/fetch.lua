@@ -0,0 +1,95 @@
+local table = require "table"
+
+local common = require "./common"
+
+local now, report = common.now, common.report
+
+-- Rows/sec, garbage collections and lua allocation per row for fetch,
+-- by column count, column width and delivery mode
+local ROWS = tonumber(process.env.ROWS) or 200000
+local ALLOC_ROWS = tonumber(process.env.ALLOC_ROWS) or 5000
+local CELL_BUDGET = 64 * 1024 * 1024    -- bytes per run, wide results get fewer rows
+local COLUMNS = {1, 4, 16}
+local WIDTHS = {8, 64, 512}
+local MODES = {"row", "batch"}
+local BATCH = 512
+
+local function generate(rows, columns, width)
+    local fields = {}
+    for i = 1, columns do
+        fields[i] = "substr(x || hex(zeroblob(" .. width .. ")), 1, " .. width .. ") AS c" .. i
+    end
+
+    return "WITH RECURSIVE seq(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM seq LIMIT " .. rows .. ") "
+        .. "SELECT " .. table.concat(fields, ", ") .. " FROM seq;"
+end
+
+-- Fetches the whole result, callback(count, elapsed) once it was read
+local function run(connection, sql, mode, callback)
+    connection:query(sql, function(err, query)
+        if err then
+            error(err)
+        end
+
+        local count = 0
+        local start = now()
+
+        query:on("fetched", function()
+            local elapsed = now() - start
+            query:close()
+            callback(count, elapsed)
+        end)
+
+        if mode == "batch" then
+            query:fetchBatch(BATCH, function(rows, n)
+                count = count + n
+            end)
+        else
+            query:on("row", function()
+                count = count + 1
+            end)
+            query:fetch()
+        end
+    end)
+end
+
+return function(connection, done)
+    local steps = {}
+
+    for _, columns in ipairs(COLUMNS) do
+        for _, width in ipairs(WIDTHS) do
+            for _, mode in ipairs(MODES) do
+                local name = string.format("fetch/%s/c%d/w%d", mode, columns, width)
+                local rows = math.max(1000, math.min(ROWS, math.floor(CELL_BUDGET / (columns * width))))
+
+                steps[#steps+1] = function(nextStep)
+                    local gc = common.gcCounter()
+                    run(connection, generate(rows, columns, width), mode, function(count, elapsed)
+                        local cycles = gc:stop()
+                        report(name, "rows", count)
+                        report(name, "rows_per_sec", count / elapsed * 1000)
+                        report(name, "mb_per_sec", count * columns * width / elapsed / 1000)
+                        report(name, "gc_cycles_per_1k_rows", cycles / count * 1000)
+                        nextStep()
+                    end)
+                end
+
+                steps[#steps+1] = function(nextStep)
+                    local sql = generate(ALLOC_ROWS, columns, width)
+                    local count
+                    common.measureAllocation(function(finished)
+                        run(connection, sql, mode, function(n)
+                            count = n
+                            finished()
+                        end)
+                    end, function(kilobytes)
+                        report(name, "alloc_bytes_per_row", kilobytes * 1024 / count)
+                        nextStep()
+                    end)
+                end
+            end
+        end
+    end
+
+    common.sequence(steps, done)
+end
@@ -0,0 +1,85 @@
+local common = require "./common"
+
+local now, report = common.now, common.report
+
+-- Per call latency of escape and of query dispatch, calls are made one after another
+local CALLS = tonumber(process.env.CALLS) or 2000
+local VALUE = "it's a \"quoted\" value"
+
+local function escapeSync(connection, done)
+    if not connection:escapeSync(VALUE) then
+        report("escape/sync", "supported", 0)
+        return done()
+    end
+
+    local samples = {}
+    for i = 1, CALLS do
+        local start = now()
+        connection:escapeSync(VALUE)
+        samples[i] = now() - start
+    end
+
+    common.reportLatency("escape/sync", samples)
+    done()
+end
+
+local function escapeAsync(connection, done)
+    local samples = {}
+
+    local function call(i)
+        if i > CALLS then
+            common.reportLatency("escape/async", samples)
+            return done()
+        end
+
+        local start = now()
+        connection:escape(VALUE, function(err)
+            if err then
+                error(err)
+            end
+            samples[i] = now() - start
+            call(i + 1)
+        end)
+    end
+    call(1)
+end
+
+-- Submit to query callback, plus the queue wait and execution the native stats attribute to it
+local function query(connection, done)
+    local samples = {}
+    local queueWait, execution = 0, 0
+
+    local function call(i)
+        if i > CALLS then
+            common.reportLatency("query/dispatch", samples)
+            report("query/dispatch", "queue_wait_mean_us", queueWait / CALLS * 1000)
+            report("query/dispatch", "execution_mean_us", execution / CALLS * 1000)
+            return done()
+        end
+
+        local start = now()
+        connection:query("SELECT 1;", function(err, q)
+            if err then
+                error(err)
+            end
+            samples[i] = now() - start
+
+            local stats = q:getStats()
+            queueWait = queueWait + stats.queueWait
+            execution = execution + stats.execution
+
+            q:close(function()
+                call(i + 1)
+            end)
+        end)
+    end
+    call(1)
+end
+
+return function(connection, done)
+    common.sequence({
+        function(nextStep) escapeSync(connection, nextStep) end,
+        function(nextStep) escapeAsync(connection, nextStep) end,
+        function(nextStep) query(connection, nextStep) end
+    }, done)
+end
@@ -0,0 +1,84 @@
+local common = require "./common"
+
+local createQueryBuilder = require "odbxuv.queryBuilder".createQueryBuilder
+
+local now, report = common.now, common.report
+
+-- QueryBuilder finalize cost for multi row inserts: escaped into a string,
+-- escaped into a native buffer and parameterized
+local SIZES = {100, 1000, 10000}
+local REPEAT = tonumber(process.env.REPEAT) or 5
+
+local function build(connection, rows, mode)
+    local q = createQueryBuilder(connection)
+    q:insert("id", "name", "score", "note")
+    q:into("bench_qb")
+    for i = 1, rows do
+        q:values(i, "name " .. i, i * 0.5, "it's row " .. i)
+    end
+    if mode == "params" then
+        q:parameterize()
+    elseif mode == "buffered" then
+        q:buffered()
+    end
+    return q
+end
+
+-- Finalizes REPEAT fresh builders one after another, callback(ms spent finalizing)
+local function finalize(connection, rows, mode, callback)
+    local total = 0
+    local i = 0
+
+    local function nextRun()
+        i = i + 1
+        if i > REPEAT then
+            return callback(total)
+        end
+
+        local q = build(connection, rows, mode)
+        local start = now()
+        q:finalize(function(err)
+            if err then
+                error(err)
+            end
+            total = total + now() - start
+            nextRun()
+        end)
+    end
+    nextRun()
+end
+
+return function(connection, done)
+    local steps = {}
+
+    for _, rows in ipairs(SIZES) do
+        for _, mode in ipairs({"escaped", "buffered", "params"}) do
+            local name = string.format("querybuilder/insert/%s/r%d", mode, rows)
+
+            steps[#steps+1] = function(nextStep)
+                finalize(connection, rows, mode, function(total)
+                    report(name, "finalize_ms", total / REPEAT)
+                    report(name, "us_per_row", total / REPEAT / rows * 1000)
+                    nextStep()
+                end)
+            end
+
+            steps[#steps+1] = function(nextStep)
+                local q = build(connection, rows, mode)
+                common.measureAllocation(function(finished)
+                    q:finalize(function(err)
+                        if err then
+                            error(err)
+                        end
+                        finished()
+                    end)
+                end, function(kilobytes)
+                    report(name, "alloc_bytes_per_row", kilobytes * 1024 / rows)
+                    nextStep()
+                end)
+            end
+        end
+    end
+
+    common.sequence(steps, done)
+end
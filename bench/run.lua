@@ -0,0 +1,34 @@
+local odbx = require "odbxuv"
+
+local common = require "./common"
+
+-- Runs the benchmarks against a local sqlite3 database (BENCH_DATABASE, default "bench").
+-- BENCH selects a single suite: fetch, latency or querybuilder
+local SUITES = {
+    {"fetch", require "./fetch"},
+    {"latency", require "./latency"},
+    {"querybuilder", require "./queryBuilder"}
+}
+
+local connection
+connection = odbx.createConnection(common.CREDENTIALS, function(err)
+    if err then
+        error(err)
+    end
+
+    local steps = {}
+    for _, suite in ipairs(SUITES) do
+        if not process.env.BENCH or process.env.BENCH == suite[1] then
+            steps[#steps+1] = function(nextStep)
+                suite[2](connection, nextStep)
+            end
+        end
+    end
+
+    print("benchmark\tmetric\tvalue")
+    common.sequence(steps, function()
+        connection:disconnect(function()
+            connection:close()
+        end)
+    end)
+end)
@@ -0,0 +1,219 @@
+local table = require "table"
+
+local odbxuv = require "odbxuv"
+local createQueryBuilder = require "odbxuv.queryBuilder".createQueryBuilder
+
+local now = odbxuv.now
+
+local function repeatList(value, count)
+    local list = {}
+    for i = 1, count do
+        list[i] = value
+    end
+    return table.concat(list, ", ")
+end
+
+-- Streams rows into a table as chunked multi row INSERT statements,
+-- every chunk is a prepared statement executed with the chunk's values
+local BulkInsert = odbxuv.Emitter:extend()
+
+-- options:
+--   batchSize    rows per INSERT statement (default 500)
+--   transaction  wrap the inserts in BEGIN/COMMIT (default true)
+function BulkInsert:initialize(connection, tableName, columns, options)
+    options = options or {}
+
+    assert(connection:canBindParams(), "BulkInsert executes prepared statements, which are only supported for sqlite3 connections")
+
+    local builder = createQueryBuilder(connection)
+    local fields = {}
+    for i, column in ipairs(columns) do
+        fields[i] = builder:escapeFieldName(column)
+    end
+
+    self.connection = connection
+    self.columns = columns
+    self.batchSize = options.batchSize or 500
+    self.transaction = options.transaction ~= false
+    self.prefix = "INSERT INTO " .. builder:escapeTableName(tableName) .. " (" .. table.concat(fields, ", ") .. ") VALUES "
+    self.statements = {}
+
+    self.values = {}
+    self.buffered = 0
+    self.chunks = {}     -- full chunks waiting for the running statement
+    self.running = false
+    self.rows = 0
+    self.started = now()
+
+    if self.transaction then
+        self:run("BEGIN")
+    end
+end
+
+-- Returns the prepared statement inserting count rows
+function BulkInsert:statement(count)
+    local statement = self.statements[count]
+    if not statement then
+        local tuple = "(" .. repeatList("?", #self.columns) .. ")"
+        statement = self.connection:prepare(self.prefix .. repeatList(tuple, count))
+        self.statements[count] = statement
+    end
+    return statement
+end
+
+-- Runs chunks one after another so they apply in order inside the transaction
+function BulkInsert:run(statement, params)
+    self.chunks[#self.chunks+1] = {statement = statement, params = params}
+    self:next()
+end
+
+function BulkInsert:next()
+    if self.running or self.failed then
+        return
+    end
+
+    local chunk = table.remove(self.chunks, 1)
+    if not chunk then
+        if self.finishing then
+            self:complete()
+        else
+            self:emit("drain")
+        end
+        return
+    end
+
+    local called = false
+    local function done(err, query)
+        -- Query callbacks run again for errors while fetching
+        if called then
+            return
+        end
+        called = true
+
+        if query then query:close() end
+        self.running = false
+
+        if err then
+            return self:fail(err)
+        end
+
+        self:next()
+    end
+
+    self.running = true
+    if chunk.params then
+        self.connection:execute(chunk.statement, chunk.params, done)
+    else
+        self.connection:query(chunk.statement, done)
+    end
+end
+
+-- Adds a row, either an array in column order or a table keyed by column name.
+-- Returns false once chunks are piling up, "drain" is emitted when they are written
+function BulkInsert:write(row)
+    assert(not self.finishing, "BulkInsert:write after finish")
+
+    if self.failed then
+        return false
+    end
+
+    local values = self.values
+    local n = #values
+    for i, column in ipairs(self.columns) do
+        local value = row[i]
+        if value == nil then
+            value = row[column]
+        end
+        if value == nil then
+            value = self.connection.NULL
+        end
+        values[n + i] = value
+    end
+
+    self.buffered = self.buffered + 1
+    self.rows = self.rows + 1
+
+    if self.buffered >= self.batchSize then
+        self:flush()
+    end
+
+    return #self.chunks == 0
+end
+
+function BulkInsert:flush()
+    if self.buffered == 0 then
+        return
+    end
+
+    local statement = self:statement(self.buffered)
+    local values = self.values
+
+    self.values = {}
+    self.buffered = 0
+    self:run(statement, values)
+end
+
+-- Writes the remaining rows and commits, callback(err, stats)
+function BulkInsert:finish(callback)
+    if self.failed then
+        if callback then
+            callback(self.error)
+        end
+        return
+    end
+
+    if callback then
+        self:once("finish", function(...) callback(nil, ...) end)
+        self:once("error", callback)
+    end
+
+    self:flush()
+    if self.transaction then
+        self:run("COMMIT")
+    end
+
+    self.finishing = true
+    self:next()
+end
+
+function BulkInsert:complete()
+    if self.completed then
+        return
+    end
+    self.completed = true
+
+    local seconds = (now() - self.started) / 1000
+    self:emit("finish", {
+        rows = self.rows,
+        seconds = seconds,
+        rowsPerSecond = seconds > 0 and self.rows / seconds or self.rows
+    })
+end
+
+-- Failures are kept for finish, "error" is only emitted to listeners there are
+-- instead of raising from inside a query callback without any
+function BulkInsert:missingHandlerType(name, ...)
+end
+
+function BulkInsert:fail(err)
+    self.failed = true
+    self.error = err
+    self.chunks = {}
+
+    if self.transaction then
+        self.connection:query("ROLLBACK", function(_, query)
+            if query then query:close() end
+        end)
+    end
+
+    self:emit("error", err)
+end
+
+local function createBulkInsert(connection, tableName, columns, options)
+    return BulkInsert:new(connection, tableName, columns, options)
+end
+
+return {
+    BulkInsert = BulkInsert,
+    createBulkInsert = createBulkInsert
+}
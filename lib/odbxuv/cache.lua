@@ -0,0 +1,523 @@
+local table = require "table"
+local timer = require "timer"
+
+local native = require "opendbxuv"
+local odbxuv = require "odbxuv"
+
+local now = odbxuv.now
+local unpack = unpack or table.unpack
+
+-- Rough memory use of a value in a cached row
+local function valueSize(value)
+    if type(value) == "string" then
+        return 24 + #value
+    end
+    return 16
+end
+
+local function trim(sql)
+    return (sql:gsub("^%s+", ""):gsub("[%s;]+$", ""))
+end
+
+-- Words that may follow a table name where an alias could be
+local CLAUSES = {}
+for word in ("WHERE JOIN INNER LEFT RIGHT FULL CROSS NATURAL OUTER ON USING GROUP ORDER LIMIT OFFSET HAVING WINDOW UNION EXCEPT INTERSECT"):gmatch("%a+") do
+    CLAUSES[word] = true
+end
+
+-- Words between the verb of a write and the table it writes
+local WRITE_MODIFIERS = {}
+for word in ("OR IGNORE REPLACE ROLLBACK ABORT FAIL LOW_PRIORITY DELAYED HIGH_PRIORITY QUICK INTO FROM"):gmatch("[%a_]+") do
+    WRITE_MODIFIERS[word] = true
+end
+
+-- Reads the table name at i, bare or quoted with "", `` or [] and optionally qualified
+-- by a schema. Returns the lower cased name and the position after it
+local function readName(sql, i)
+    local parts = {}
+    repeat
+        i = sql:match("^%s*()", i)
+        local open = sql:sub(i, i)
+        local close = open == "[" and "]" or (open == "`" or open == '"') and open
+        local part
+        if close then
+            local stop = sql:find(close, i + 1, true)
+            if not stop then
+                return
+            end
+            part, i = sql:sub(i + 1, stop - 1), stop + 1
+        else
+            part, i = sql:match("^([%w_]+)()", i)
+            if not part then
+                return
+            end
+        end
+        parts[#parts+1] = part
+
+        local qualified = sql:sub(i, i) == "."
+        if qualified then
+            i = i + 1
+        end
+    until not qualified
+
+    return table.concat(parts, "."):lower(), i
+end
+
+-- Skips the alias after a table name at i, "AS x" or a bare "x"
+local function skipAlias(sql, i)
+    local word, after = sql:match("^%s*([%a_][%w_]*)()", i)
+    if not word or CLAUSES[word:upper()] then
+        return i
+    end
+    if word:upper() == "AS" then
+        local _, stop = readName(sql, after)
+        return stop or after
+    end
+    return after
+end
+
+-- Tables read by a SELECT, used to invalidate its entries when one of them is written.
+-- Every FROM and JOIN is looked at, including those of subqueries, as are table lists
+-- like FROM a x, b y
+local function readTables(sql)
+    local tables, seen = {}, {}
+
+    for i, word in sql:gmatch("()([%w_]+)") do
+        word = word:upper()
+        if word == "FROM" or word == "JOIN" then
+            local name, after = readName(sql, i + #word)
+            while name do
+                if not seen[name] then
+                    seen[name] = true
+                    tables[#tables+1] = name
+                end
+
+                local comma = sql:match("^%s*,()", skipAlias(sql, after))
+                if word ~= "FROM" or not comma then
+                    break
+                end
+                name, after = readName(sql, comma)
+            end
+        end
+    end
+
+    return tables
+end
+
+-- Table written by an INSERT, UPDATE, DELETE or REPLACE, nil for other statements
+local function writtenTable(sql)
+    local verb, i = sql:match("^%s*(%a+)()")
+    verb = verb and verb:upper()
+    if verb ~= "INSERT" and verb ~= "REPLACE" and verb ~= "DELETE" and verb ~= "UPDATE" then
+        return
+    end
+
+    -- INSERT OR REPLACE INTO t, DELETE LOW_PRIORITY FROM t, ...
+    local word, after = sql:match("^%s*([%a_]+)()", i)
+    while word and WRITE_MODIFIERS[word:upper()] do
+        i = after
+        word, after = sql:match("^%s*([%a_]+)()", i)
+    end
+
+    return (readName(sql, i))
+end
+
+-- A query answered from the cache, emits the same events as a fetched Query.
+-- Rows are shared with the cache and must not be modified
+local CachedQuery = odbxuv.Query:extend()
+
+function CachedQuery:initialize(sql)
+    self.query = sql
+end
+
+function CachedQuery:isNativeHandlerType()
+    return false
+end
+
+-- Called with the cache entry once it is available
+function CachedQuery:ready(entry)
+    self.entry = entry
+    self:emit("query")
+end
+
+function CachedQuery:fetch(callback, options)
+    if callback then
+        self:once("fetch", callback)
+    end
+
+    options = options or {}
+
+    -- Deliver asynchronously like the native fetch
+    timer.setTimeout(0, function()
+        self:replay(options)
+    end)
+end
+
+function CachedQuery:replay(options)
+    local entry = self.entry
+    local rows, names = entry.rows, entry.names
+    local batch = options.batch or 0
+
+    local function shape(row)
+        if not options.named then
+            return row
+        end
+        local named = {}
+        for i, name in ipairs(names) do
+            named[name] = row[i]
+        end
+        return named
+    end
+
+    self:emit("fetch")
+
+    if batch > 0 then
+        for first = 1, #rows, batch do
+            local chunk = {}
+            for i = first, math.min(first + batch - 1, #rows) do
+                chunk[#chunk+1] = shape(rows[i])
+            end
+            self:emit("rows", chunk, #chunk)
+        end
+    else
+        local count = #names
+        for _, row in ipairs(rows) do
+            if options.named then
+                self:emit("row", shape(row))
+            else
+                self:emit("row", unpack(row, 1, count))
+            end
+        end
+    end
+
+    self:emit("fetched")
+end
+
+function CachedQuery:fetchColumnar()
+    error("Cached results can not be fetched columnar")
+end
+
+-- Rows are in memory already, there is nothing to hold back
+function CachedQuery:pause()
+end
+
+function CachedQuery:resume()
+end
+
+function CachedQuery:close(cb)
+    if cb then
+        self:once("close", cb)
+    end
+
+    timer.setTimeout(0, function()
+        self:emit("close")
+    end)
+end
+
+function CachedQuery:getStats()
+    return {cached = true, rows = #self.entry.rows}
+end
+
+function CachedQuery:getColumnCount()
+    return #self.entry.names
+end
+
+function CachedQuery:getAffectedCount()
+    return 0
+end
+
+function CachedQuery:getColumnInfo(i)
+    return self.entry.names[i], self.entry.types[i]
+end
+
+-- Keeps materialized results of SELECTs, bounded by age and memory
+local ResultCache = odbxuv.Emitter:extend()
+
+-- options:
+--   ttl       ms an entry is served for (default 60000)
+--   maxBytes  estimated memory of all entries, least recently used ones are evicted beyond it (default 16MB)
+function ResultCache:initialize(options)
+    options = options or {}
+
+    self.ttl = options.ttl or 60000
+    self.maxBytes = options.maxBytes or 16 * 1024 * 1024
+
+    self.entries = {}   -- key -> entry
+    self.tables = {}    -- table name -> {key = true}
+    self.loading = {}   -- key -> CachedQuery objects waiting for the same result
+    self.bytes = 0
+    self.count = 0
+    self.epoch = 0      -- bumped by every invalidation, loads that overlap one are not stored
+
+    -- Least recently used list, head is the next to evict
+    self.head = nil
+    self.tail = nil
+
+    self.counters = {
+        hits = 0,
+        misses = 0,
+        evictions = 0,
+        expirations = 0,
+        invalidations = 0
+    }
+end
+
+function ResultCache:unlink(entry)
+    if entry.prev then entry.prev.next = entry.next else self.head = entry.next end
+    if entry.next then entry.next.prev = entry.prev else self.tail = entry.prev end
+    entry.prev, entry.next = nil, nil
+end
+
+function ResultCache:append(entry)
+    entry.prev = self.tail
+    if self.tail then self.tail.next = entry else self.head = entry end
+    self.tail = entry
+end
+
+function ResultCache:remove(entry)
+    self:unlink(entry)
+    self.entries[entry.key] = nil
+    self.bytes = self.bytes - entry.bytes
+    self.count = self.count - 1
+
+    for _, name in ipairs(entry.tables) do
+        local keys = self.tables[name]
+        if keys then
+            keys[entry.key] = nil
+        end
+    end
+end
+
+-- Returns the live entry for key and marks it as recently used
+function ResultCache:get(key)
+    local entry = self.entries[key]
+    if not entry then
+        return
+    end
+
+    if entry.expires <= now() then
+        self.counters.expirations = self.counters.expirations + 1
+        self:remove(entry)
+        return
+    end
+
+    self:unlink(entry)
+    self:append(entry)
+    return entry
+end
+
+function ResultCache:set(key, entry)
+    local old = self.entries[key]
+    if old then
+        self:remove(old)
+    end
+
+    -- Results that would push out everything else are not kept
+    if entry.bytes > self.maxBytes then
+        return
+    end
+
+    entry.key = key
+    self.entries[key] = entry
+    self.bytes = self.bytes + entry.bytes
+    self.count = self.count + 1
+    self:append(entry)
+
+    for _, name in ipairs(entry.tables) do
+        self.tables[name] = self.tables[name] or {}
+        self.tables[name][key] = true
+    end
+
+    while self.bytes > self.maxBytes and self.head do
+        self.counters.evictions = self.counters.evictions + 1
+        self:remove(self.head)
+    end
+end
+
+-- Drops the entries reading from tableName, or every entry without a name
+function ResultCache:invalidate(tableName)
+    self.epoch = self.epoch + 1
+
+    if not tableName then
+        self.counters.invalidations = self.counters.invalidations + self.count
+        self.entries, self.tables = {}, {}
+        self.head, self.tail = nil, nil
+        self.bytes, self.count = 0, 0
+        return
+    end
+
+    local keys = self.tables[tableName:lower()]
+    if not keys then
+        return
+    end
+
+    for key in pairs(keys) do
+        local entry = self.entries[key]
+        if entry then
+            self.counters.invalidations = self.counters.invalidations + 1
+            self:remove(entry)
+        end
+    end
+    self.tables[tableName:lower()] = nil
+end
+
+-- Invalidates the table written by sql, if any
+function ResultCache:observe(sql)
+    local name = writtenTable(sql)
+    if name then
+        self:invalidate(name)
+    end
+end
+
+-- Serves key from the cache, or runs run(callback) to load it and fetches all of its rows.
+-- Concurrent misses for the same key share a single load
+function ResultCache:load(key, sql, options, run, callback)
+    local cached = CachedQuery:new(sql)
+
+    if callback then
+        cached:on("error", function(err)
+            callback(err, cached)
+        end)
+        cached:once("query", function(...)
+            callback(nil, cached, ...)
+        end)
+    end
+
+    local entry = self:get(key)
+    if entry then
+        self.counters.hits = self.counters.hits + 1
+        timer.setTimeout(0, function()
+            cached:ready(entry)
+        end)
+        return cached
+    end
+
+    self.counters.misses = self.counters.misses + 1
+
+    local waiting = self.loading[key]
+    if waiting then
+        waiting[#waiting+1] = cached
+        return cached
+    end
+    waiting = {cached}
+    self.loading[key] = waiting
+
+    local epoch = self.epoch
+
+    local function finish(err, entry)
+        self.loading[key] = nil
+        for _, query in ipairs(waiting) do
+            if err then
+                query:emit("error", err)
+            else
+                query:ready(entry)
+            end
+        end
+    end
+
+    run(function(err, query)
+        if err then
+            if query then query:close() end
+            return finish(err)
+        end
+
+        local rows, bytes = {}, 0
+        local names, types = {}, {}
+
+        query:once("fetch", function()
+            for i = 1, query:getColumnCount() do
+                names[i], types[i] = query:getColumnInfo(i)
+            end
+        end)
+
+        query:fetchBatch(256, function(batch, n)
+            for i = 1, n do
+                local row = batch[i]
+                bytes = bytes + 40
+                for _, value in ipairs(row) do
+                    bytes = bytes + valueSize(value)
+                end
+                rows[#rows+1] = row
+            end
+        end)
+
+        query:once("fetched", function()
+            query:close()
+
+            local tables = readTables(sql)
+            if options.tables then
+                tables = {}
+                for i, name in ipairs(options.tables) do
+                    tables[i] = name:lower()
+                end
+            end
+
+            local entry = {
+                rows = rows,
+                names = names,
+                types = types,
+                bytes = bytes,
+                tables = tables,
+                expires = now() + (type(options.cache) == "number" and options.cache or self.ttl)
+            }
+
+            -- A write may have happened while the rows were read
+            if epoch == self.epoch then
+                self:set(key, entry)
+            end
+            finish(nil, entry)
+        end)
+    end)
+
+    return cached
+end
+
+-- Connection:query through the cache, the key is the trimmed sql text
+function ResultCache:query(connection, sql, options, callback)
+    local key = (options.typed and "t:" or "s:") .. trim(sql)
+
+    return self:load(key, sql, options, function(cb)
+        connection:query(sql, {flags = options.flags, typed = options.typed}, cb)
+    end, callback)
+end
+
+-- Connection:execute through the cache, the key is the sql with the parameters spliced in
+function ResultCache:execute(connection, statement, params, options, callback)
+    if type(statement) == "string" then
+        statement = connection:cachedStatement(statement)
+    end
+
+    local sql = native.format(statement.handle, params)
+    local key = (options.typed and "t:" or "s:") .. trim(sql)
+
+    return self:load(key, statement.query, options, function(cb)
+        connection:execute(statement, params, {flags = options.flags, typed = options.typed}, cb)
+    end, callback)
+end
+
+function ResultCache:getStats()
+    local counters = self.counters
+    local lookups = counters.hits + counters.misses
+    return {
+        entries = self.count,
+        bytes = self.bytes,
+        hits = counters.hits,
+        misses = counters.misses,
+        hitRate = lookups > 0 and counters.hits / lookups or 0,
+        evictions = counters.evictions,
+        expirations = counters.expirations,
+        invalidations = counters.invalidations
+    }
+end
+
+local function createResultCache(options)
+    return ResultCache:new(options)
+end
+
+return {
+    ResultCache = ResultCache,
+    CachedQuery = CachedQuery,
+    createResultCache = createResultCache,
+    readTables = readTables,
+    writtenTable = writtenTable
+}
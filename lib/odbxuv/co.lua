@@ -0,0 +1,252 @@
+local native = require "opendbxuv"
+local createStatementCache = require "odbxuv.statementCache".createStatementCache
+
+-- Straight-line api for use inside coroutines, every call that waits on the
+-- database yields the running coroutine and is resumed from the native callback.
+-- Errors are raised instead of emitted. Does not depend on luvit.
+
+local Connection = {}
+Connection.__index = Connection
+Connection.NULL = native.NULL
+
+local Query = {}
+Query.__index = Query
+
+-- Waits until the handle emitted the given event, skipping others.
+-- Returns nil, err on "error" events, yielding across pcall is not possible in Lua 5.1
+local function awaitEvent(handle, name)
+    while true do
+        local event, value = native.await(handle)
+        if event == name then
+            return true, value
+        elseif event == "error" then
+            return nil, value
+        end
+    end
+end
+
+local function closeHandle(handle)
+    native.close(handle)
+    awaitEvent(handle, "close")
+end
+
+local function connect(credentials)
+    local handle = native.createHandle()
+    native.setCoroutineMode(handle, true)
+
+    native.connect(
+        handle,
+        credentials.type,
+        credentials.host or "localhost",
+        credentials.port and credentials.port > 0 and credentials.port or nil,
+        credentials.database,
+        credentials.username,
+        credentials.password)
+
+    if credentials.maxInFlight then
+        native.setMaxInFlight(handle, credentials.maxInFlight)
+    end
+
+    local ok, err = awaitEvent(handle, "connect")
+    if not ok then
+        closeHandle(handle)
+        error(err, 0)
+    end
+
+    return setmetatable({
+        handle = handle,
+        type = credentials.type,
+        statementCacheSize = credentials.statementCacheSize or 64
+    }, Connection)
+end
+
+-- Runs the query and returns once the backend executed it.
+-- options as for Connection:query, plus the fetch options (batch, named, highWaterMark)
+function Connection:query(sql, options)
+    if type(options) ~= "table" then
+        options = {flags = options}
+    end
+
+    local handle = native.query(self.handle, sql, options.flags or 255, options)
+
+    local ok, err = awaitEvent(handle, "query")
+    if not ok then
+        closeHandle(handle)
+        error(err, 0)
+    end
+
+    return setmetatable({handle = handle, options = options}, Query)
+end
+
+-- Runs a prepared statement (or sql text) with parameters, see Connection:execute
+function Connection:execute(statement, params, options)
+    if type(options) ~= "table" then
+        options = {flags = options}
+    end
+
+    if type(statement) == "string" then
+        statement = self:cachedStatement(statement)
+    end
+
+    local handle = native.execute(statement, params, options.flags or 255, options)
+
+    local ok, err = awaitEvent(handle, "query")
+    if not ok then
+        closeHandle(handle)
+        error(err, 0)
+    end
+
+    return setmetatable({handle = handle, options = options}, Query)
+end
+
+function Connection:prepare(sql)
+    return native.prepare(self.handle, sql)
+end
+
+-- Returns the prepared statement for sql from the statement cache, preparing it on a miss
+function Connection:cachedStatement(sql)
+    local cache = self.statementCache
+    if not cache then
+        cache = createStatementCache(self.statementCacheSize)
+        self.statementCache = cache
+    end
+
+    local statement = cache:get(sql)
+    if not statement then
+        statement = self:prepare(sql)
+        cache:set(sql, statement)
+    end
+    return statement
+end
+
+-- Returns {size, maxSize, hits, misses, evictions, hitRate} of the statement cache
+function Connection:getStatementCacheStats()
+    return (self.statementCache or createStatementCache(self.statementCacheSize)):getStats()
+end
+
+function Connection:escape(value)
+    local escaped = native.escapeSync(self.handle, value)
+    if escaped then
+        return escaped
+    end
+
+    local handle = native.escape(self.handle, value)
+    local ok, result = awaitEvent(handle, "escape")
+    closeHandle(handle)
+    if not ok then
+        error(result, 0)
+    end
+    return result
+end
+
+function Connection:disconnect()
+    native.disconnect(self.handle)
+    self.statementCache = nil
+    local ok, err = awaitEvent(self.handle, "disconnect")
+    if not ok then
+        error(err, 0)
+    end
+end
+
+function Connection:getStats(reset)
+    return native.connectionStats(self.handle, reset)
+end
+
+function Connection:close()
+    if self.handle then
+        closeHandle(self.handle)
+        self.handle = nil
+    end
+end
+
+-- Returns the values of the next row, the row table in named mode or
+-- (rows, count) in batch mode. Returns nothing once all rows were read
+function Query:next()
+    if self.done then
+        return
+    end
+
+    if not self.fetching then
+        self.fetching = true
+        native.fetch(self.handle, self.options)
+    end
+
+    return self:nextEvent(native.await(self.handle))
+end
+
+function Query:nextEvent(event, ...)
+    if event == "row" or event == "rows" then
+        return ...
+    elseif event == "fetched" then
+        self.done = true
+        return
+    elseif event == "error" then
+        self.done = true
+        error((...), 0)
+    end
+
+    -- "fetch" and "pause" carry no rows
+    return self:nextEvent(native.await(self.handle))
+end
+
+-- Iterator over the remaining rows, for values in query:rows() do ... end
+function Query:rows()
+    return function()
+        return self:next()
+    end
+end
+
+-- Reads the whole result into an odbxuv.columnar Columnar
+function Query:fetchColumnar()
+    assert(not self.fetching, "Query is already being fetched")
+    self.fetching = true
+    self.done = true
+
+    native.fetch(self.handle, {columnar = true})
+
+    local ok, data = awaitEvent(self.handle, "columnar")
+    if not ok then
+        error(data, 0)
+    end
+
+    local names = {}
+    for i = 1, self:getColumnCount() do
+        names[i] = self:getColumnInfo(i)
+    end
+
+    return require "odbxuv.columnar".Columnar.new(data, names)
+end
+
+function Query:cancel()
+    return native.cancel(self.handle)
+end
+
+function Query:getColumnCount()
+    return native.queryColumnCount(self.handle)
+end
+
+function Query:getAffectedCount()
+    return native.queryAffectedCount(self.handle)
+end
+
+function Query:getColumnInfo(i)
+    return native.queryColumnInfo(self.handle, i)
+end
+
+function Query:getStats()
+    return native.queryStats(self.handle)
+end
+
+function Query:close()
+    if self.handle then
+        closeHandle(self.handle)
+        self.handle = nil
+    end
+end
+
+return {
+    Connection = Connection,
+    Query = Query,
+    NULL = native.NULL,
+    connect = connect
+}
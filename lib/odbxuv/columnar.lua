@@ -0,0 +1,151 @@
+local ffi = require "ffi"
+local bit = require "bit"
+
+local NULL = require "opendbxuv".NULL
+
+-- Mirrors odbxuv_lua_column_t and odbxuv_lua_columnar_t in lua_opendbxuv.c
+ffi.cdef[[
+typedef struct {
+    int kind;
+    int64_t* integers;
+    double* numbers;
+    size_t* offsets;
+    char* bytes;
+    uint8_t* nulls;
+    size_t capacity;
+    size_t byteLength;
+    size_t byteCapacity;
+} odbxuv_lua_column_t;
+
+typedef struct {
+    size_t rowCount;
+    int columnCount;
+    odbxuv_lua_column_t* columns;
+} odbxuv_lua_columnar_t;
+]]
+
+local KIND_STRING, KIND_INTEGER, KIND_NUMBER, KIND_BOOLEAN = 0, 1, 2, 3
+local KINDS = {[KIND_STRING] = "string", [KIND_INTEGER] = "integer", [KIND_NUMBER] = "number", [KIND_BOOLEAN] = "boolean"}
+
+-- Integers beyond this do not fit a lua number exactly (ODBXUV_LUA_MAX_EXACT_INTEGER)
+local MAX_EXACT_INTEGER = 2^53
+
+-- An int64 as a lua number, or as an exact string beyond 2^53 like typed rows do
+local function integerValue(value)
+    if value > MAX_EXACT_INTEGER or value < -MAX_EXACT_INTEGER then
+        return (tostring(value):sub(1, -3))
+    end
+    return tonumber(value)
+end
+
+-- A whole result stored as one array per column.
+-- Rows are 0 based like the underlying arrays, columns are 1 based or names.
+-- The arrays returned by integers/numbers/offsets/bytes/nulls are only valid while this object is alive.
+local Columnar = {}
+Columnar.__index = Columnar
+
+function Columnar.new(userdata, names)
+    local data = ffi.cast("odbxuv_lua_columnar_t*", userdata)
+    local self = setmetatable({
+        userdata = userdata, -- keeps the memory alive
+        data = data,
+        rowCount = tonumber(data.rowCount),
+        columnCount = data.columnCount,
+        names = names,
+        indices = {}
+    }, Columnar)
+
+    for i, name in ipairs(names) do
+        self.indices[name] = i
+    end
+
+    return self
+end
+
+function Columnar:column(column)
+    local i = type(column) == "string" and self.indices[column] or column
+    assert(type(i) == "number" and i >= 1 and i <= self.columnCount, "Unknown column " .. tostring(column))
+    return self.data.columns[i - 1]
+end
+
+-- "integer", "number", "boolean" or "string"
+function Columnar:kind(column)
+    return KINDS[self:column(column).kind]
+end
+
+-- int64_t array of integer and boolean columns
+function Columnar:integers(column)
+    local c = self:column(column)
+    assert(c.kind == KIND_INTEGER or c.kind == KIND_BOOLEAN, "Column is not an integer column")
+    return c.integers
+end
+
+-- double array of number columns
+function Columnar:numbers(column)
+    local c = self:column(column)
+    assert(c.kind == KIND_NUMBER, "Column is not a number column")
+    return c.numbers
+end
+
+-- offsets and bytes of string columns, value row is bytes + offsets[row] up to offsets[row + 1]
+function Columnar:text(column)
+    local c = self:column(column)
+    assert(c.kind == KIND_STRING, "Column is not a string column")
+    return c.offsets, c.bytes
+end
+
+-- The null bitmap, bit row % 8 of byte row / 8 is set for NULL values
+function Columnar:nulls(column)
+    return self:column(column).nulls
+end
+
+function Columnar:isNull(column, row)
+    local nulls = self:column(column).nulls
+    return bit.band(nulls[bit.rshift(row, 3)], bit.lshift(1, bit.band(row, 7))) ~= 0
+end
+
+-- Converts a single value into a lua value, NULL values become NULL.
+-- Integers beyond 2^53 are returned as strings
+function Columnar:get(column, row)
+    assert(row >= 0 and row < self.rowCount, "Row out of range")
+
+    local c = self:column(column)
+    if bit.band(c.nulls[bit.rshift(row, 3)], bit.lshift(1, bit.band(row, 7))) ~= 0 then
+        return NULL
+    end
+
+    if c.kind == KIND_INTEGER then
+        return integerValue(c.integers[row])
+    elseif c.kind == KIND_NUMBER then
+        return c.numbers[row]
+    elseif c.kind == KIND_BOOLEAN then
+        return c.integers[row] ~= 0
+    end
+
+    return ffi.string(c.bytes + c.offsets[row], c.offsets[row + 1] - c.offsets[row])
+end
+
+-- Sums a numeric column skipping NULL values. Integer columns are summed as int64,
+-- a sum beyond 2^53 is returned as a string
+function Columnar:sum(column)
+    local c = self:column(column)
+    local values = c.kind == KIND_NUMBER and c.numbers or c.kind ~= KIND_STRING and c.integers
+    assert(values, "Column is not numeric")
+
+    local nulls = c.nulls
+    local sum = c.kind == KIND_NUMBER and 0 or ffi.new("int64_t", 0)
+    for row = 0, self.rowCount - 1 do
+        if bit.band(nulls[bit.rshift(row, 3)], bit.lshift(1, bit.band(row, 7))) == 0 then
+            sum = sum + values[row]
+        end
+    end
+
+    if c.kind == KIND_NUMBER then
+        return sum
+    end
+    return integerValue(sum)
+end
+
+return {
+    Columnar = Columnar
+}
@@ -0,0 +1,236 @@
+local table = require "table"
+local timer = require "timer"
+
+local odbxuv = require "odbxuv"
+
+-- Pages through a SELECT by key instead of LIMIT/OFFSET, every page continues
+-- after the key of the last row of the previous one. The key has to be a unique
+-- (ideally indexed) column of the result. The next page is fetched while the
+-- current one is handled.
+local Cursor = odbxuv.Emitter:extend()
+
+-- options:
+--   key         column to page by (default "id")
+--   pageSize    rows per page (default 1000)
+--   descending  page from the highest key down
+--   named       pages hold tables keyed by column name instead of arrays
+--   typed       convert column values as for Connection:query (default true, keys compare as numbers,
+--               integer keys beyond 2^53 stay strings and are written into the sql as they are)
+--   params      parameters of sql, as for Connection:execute
+--   prefetch    pages fetched ahead of the one being handled (default 1)
+function Cursor:initialize(connection, sql, options)
+    options = options or {}
+
+    assert(connection:canBindParams(), "Cursor executes prepared statements, which are only supported for sqlite3 connections")
+
+    self.connection = connection
+    self.key = options.key or "id"
+    self.pageSize = options.pageSize or 1000
+    self.named = options.named
+    self.typed = options.typed ~= false
+    self.params = options.params or {}
+    self.prefetchPages = options.prefetch or 1
+
+    local descending = options.descending
+    local inner = "SELECT * FROM (" .. sql:gsub("[%s;]+$", "") .. ") odbxuv_cursor"
+    local order = " ORDER BY " .. self.key .. (descending and " DESC" or " ASC") .. " LIMIT " .. self.pageSize
+
+    self.firstSql = inner .. order
+    self.nextSql = inner .. " WHERE " .. self.key .. (descending and " < " or " > ") .. ":odbxuv_after" .. order
+
+    self.ready = {}         -- fetched pages {err, rows, count} not handed out yet
+    self.loading = false
+    self.exhausted = false  -- a short page was read, there is nothing after it
+    self.after = nil        -- key of the last row read
+end
+
+-- Position of the key in positional rows
+function Cursor:keyIndex(query)
+    for i = 1, query:getColumnCount() do
+        if query:getColumnInfo(i) == self.key then
+            return i
+        end
+    end
+    error("Cursor key " .. self.key .. " is not a column of the result")
+end
+
+function Cursor:load()
+    self.loading = true
+
+    local params = {}
+    for k, v in pairs(self.params) do
+        params[k] = v
+    end
+    params.odbxuv_after = self.after
+
+    local sql = self.after == nil and self.firstSql or self.nextSql
+
+    -- Quoted, a big integer key would compare as text or as a rounded double
+    if self.typed and type(self.after) == "string" and self.after:match("^%-?%d+$") then
+        sql = sql:gsub(":odbxuv_after", self.after)
+        params.odbxuv_after = nil
+    end
+    local finished = false
+
+    local function done(err, rows, count)
+        -- Query callbacks run again for errors while fetching
+        if finished then
+            return
+        end
+        finished = true
+        self.loading = false
+        self:deliver(err, rows, count)
+    end
+
+    self.connection:execute(sql, params, {typed = self.typed}, function(err, query)
+        if err then
+            if query then query:close() end
+            return done(err)
+        end
+
+        local rows, count = {}, 0
+        local keyIndex
+
+        query:once("fetch", function()
+            if not self.named then
+                local ok, result = pcall(self.keyIndex, self, query)
+                if ok then
+                    keyIndex = result
+                else
+                    err = result
+                end
+            end
+        end)
+
+        query:fetchBatch(self.pageSize, function(batch, n)
+            for i = 1, n do
+                rows[count + i] = batch[i]
+            end
+            count = count + n
+        end, {named = self.named})
+
+        query:once("fetched", function()
+            query:close()
+
+            if err then
+                return done(err)
+            end
+
+            if count > 0 then
+                local last = rows[count]
+                self.after = last[self.named and self.key or keyIndex]
+            end
+            if count < self.pageSize then
+                self.exhausted = true
+            end
+
+            done(nil, rows, count)
+        end)
+    end)
+end
+
+function Cursor:deliver(err, rows, count)
+    if self.closed then
+        return
+    end
+
+    if err then
+        self.exhausted = true
+    end
+
+    self.ready[#self.ready+1] = {err = err, rows = rows, count = count}
+    self:prefetch()
+
+    if self.waiter then
+        local waiter = self.waiter
+        self.waiter = nil
+        self:next(waiter)
+    end
+end
+
+-- Starts loading the next page unless enough are loaded already
+function Cursor:prefetch()
+    if not self.loading and not self.exhausted and not self.closed and #self.ready < self.prefetchPages then
+        self:load()
+    end
+end
+
+-- callback(err, rows, count) with the next page, rows is nil after the last one
+function Cursor:next(callback)
+    assert(not self.waiter, "Cursor:next called while waiting for a page")
+
+    local page = table.remove(self.ready, 1)
+    if not page then
+        if self.exhausted or self.closed then
+            return timer.setTimeout(0, function()
+                callback()
+            end)
+        end
+
+        self.waiter = callback
+        return self:prefetch()
+    end
+
+    -- Handing out a page makes room for the next one
+    self:prefetch()
+
+    timer.setTimeout(0, function()
+        if page.err then
+            callback(page.err)
+        elseif page.count == 0 then
+            callback()
+        else
+            callback(nil, page.rows, page.count)
+        end
+    end)
+end
+
+-- Calls fn(rows, count, done) for every page, the next page is handed out once done() is called.
+-- done(err) stops early. callback(err) after the last page or the first error
+function Cursor:each(fn, callback)
+    local function step(err)
+        if err then
+            self:close()
+            if callback then callback(err) end
+            return
+        end
+
+        self:next(function(err, rows, count)
+            if err or not rows then
+                self:close()
+                if callback then callback(err) end
+                return
+            end
+
+            local called = false
+            local function done(err)
+                if not called then
+                    called = true
+                    step(err)
+                end
+            end
+
+            local ok, e = pcall(fn, rows, count, done)
+            if not ok then
+                done(e)
+            end
+        end)
+    end
+    step()
+end
+
+-- Stops fetching, a page still loading is dropped when it arrives
+function Cursor:close()
+    self.closed = true
+    self.ready = {}
+    self.waiter = nil
+end
+
+local function createCursor(connection, sql, options)
+    return Cursor:new(connection, sql, options)
+end
+
+return {
+    Cursor = Cursor,
+    createCursor = createCursor
+}
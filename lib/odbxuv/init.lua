@@ -1,13 +1,14 @@
 
 local native = require "opendbxuv"
 local ffi = require "ffi"
+local createStatementCache = require "odbxuv.statementCache".createStatementCache
 
 local Emitter
 pcall(function() Emitter = require "luvit.core".Emitter end)
 -- TODO: use own class implementation if used without luvit
 assert(Emitter, "odbxuv's programmer is being lazy, he did not implement a custom Emitter implementation yet and therefore you are required to have luvit installed")
 
-local NULL = {}
+local NULL = native.NULL
 
 local Handle = Emitter:extend()
 Handle.NULL = NULL
@@ -45,8 +46,19 @@ function Connection:isNativeHandlerType(type)
     return type == "connect" or type == "disconnect" or type == "error" or type == "close"
 end
 
+-- credentials.maxInFlight limits the queries handed to the backend at once,
+-- further queries wait in order in the connection queue.
+-- credentials.multiStatements tells that the backend runs sql text holding several statements.
+-- credentials.statementCacheSize bounds the prepared statements kept by sql text (default 64)
 function Connection:connect(credentials, callback)
     self.type = credentials.type
+    self.multiStatements = credentials.multiStatements
+    self.statementCacheSize = credentials.statementCacheSize or 64
+    self.statementCache = nil
+
+    if credentials.maxInFlight then
+        native.setMaxInFlight(self.handle, credentials.maxInFlight)
+    end
 
     native.connect(
         self.handle,
@@ -69,6 +81,7 @@ end
 
 function Connection:disconnect(callback)
     native.disconnect(self.handle)
+    self.statementCache = nil
 
     if callback then
         self:once("disconnect", callback)
@@ -102,22 +115,60 @@ function Connection:escape(value, callback)
     native.setHandler(escapeHandle, "close", function() end)
 end
 
-local Query = Handle:extend()
+function Connection:setMaxInFlight(n)
+    native.setMaxInFlight(self.handle, n)
+end
 
-function Query:isNativeHandlerType(type)
-    return type == "query" or type == "row" or type == "fetched" or type == "error" or type == "close" or type == "fetch"
+-- Returns the amount of queued and running queries
+function Connection:getQueueInfo()
+    return native.queueInfo(self.handle)
 end
 
-function Connection:query(query, flags, callback)
-    if type(flags) == "function" then
-        callback = flags
-        flags = nil
-    end
+-- Returns {count, mean, p50, p99, max} in milliseconds of the queueWait, execution,
+-- fetch and callback times of the queries of this connection, reset starts over afterwards
+function Connection:getStats(reset)
+    return native.connectionStats(self.handle, reset)
+end
 
-    assert(self.handle ~= nil, "Connection went away ...")
+-- Serves queries run with options.cache from cache, a ResultCache that may be shared
+-- between connections. Writes through this connection invalidate the tables they touch
+function Connection:setCache(cache)
+    self.cache = cache
+end
 
-    local q = native.query(self.handle, query, flags or 255)
+-- Returns a writer inserting rows into tableName with chunked multi row statements,
+-- see odbxuv.bulkInsert for the options
+function Connection:bulkInsert(tableName, columns, options)
+    return require "odbxuv.bulkInsert".createBulkInsert(self, tableName, columns, options)
+end
+
+-- Runs fn(tx, done) in a transaction, committing once done() is called and every query of
+-- tx finished, rolling back when done(err) is called, fn raises or a query of tx fails.
+-- callback(err) is called after the commit or rollback, see odbxuv.transaction
+function Connection:transaction(fn, callback)
+    return require "odbxuv.transaction".runTransaction(self, fn, callback)
+end
 
+-- Pages through the result of sql by options.key with LIMIT pageSize queries that continue
+-- after the last key read, the next page is fetched while the current one is handled.
+-- See odbxuv.cursor for the options
+function Connection:cursor(sql, options)
+    return require "odbxuv.cursor".createCursor(self, sql, options)
+end
+
+-- Escapes the value on the calling thread, returns nil when the backend needs Connection:escape
+-- (every backend but sqlite3, mysql escaping depends on the session charset and sql_mode)
+function Connection:escapeSync(value)
+    return native.escapeSync(self.handle, value)
+end
+
+local Query = Handle:extend()
+
+function Query:isNativeHandlerType(type)
+    return type == "query" or type == "row" or type == "rows" or type == "fetched" or type == "pause" or type == "error" or type == "close" or type == "fetch" or type == "columnar"
+end
+
+local function wrapQuery(q, query, callback)
     local wrappedQuery = Query:new(q)
 
     if callback then
@@ -133,30 +184,224 @@ function Connection:query(query, flags, callback)
     return wrappedQuery
 end
 
+local function queryOptions(options, callback)
+    if type(options) == "function" then
+        callback = options
+        options = nil
+    end
+
+    if type(options) ~= "table" then
+        options = {flags = options}
+    end
+
+    return options, callback
+end
+
+-- options is either the numeric query flags or a table with:
+--   flags   numeric query flags (defaults to 255)
+--   params  parameters for ? and :name placeholders, the query then runs as a cached
+--           prepared statement like Connection:execute
+--   typed   push integer, float and boolean columns as lua numbers and booleans,
+--           integers beyond 2^53 stay strings as a number would round them
+--   timeout ms the query may wait and execute before it fails with an error whose
+--           code is "TIMEOUT", see Query:cancel
+--   cache   serve the result from the cache set with Connection:setCache, true uses
+--           the ttl of the cache, a number is the ttl in ms
+--   tables  tables the query reads, invalidating them drops the cached result
+--           (defaults to the tables after FROM and JOIN)
+-- query may also be a buffer from native.buffer, it is submitted without a copy
+-- and is empty again once the query succeeded, a failed query leaves it intact for a retry
+function Connection:query(query, options, callback)
+    options, callback = queryOptions(options, callback)
+
+    assert(self.handle ~= nil, "Connection went away ...")
+
+    -- Parameters and cached results need the sql as a string
+    if type(query) ~= "string" and (options.params or (self.cache and options.cache)) then
+        query = native.bufferToString(query)
+    end
+
+    if options.params then
+        return self:execute(query, options.params, options, callback)
+    end
+
+    -- The start of a buffer is enough to tell what it writes and for error messages
+    local text = type(query) == "string" and query or native.bufferToString(query, 256)
+
+    if self.cache then
+        if options.cache then
+            return self.cache:query(self, query, options, callback)
+        end
+        self.cache:observe(text)
+    end
+
+    local q = native.query(self.handle, query, options.flags or 255, options)
+
+    return wrapQuery(q, text, callback)
+end
+
+-- Parses sql with ? and :name placeholders once so it can be executed many times, sqlite3 only
+function Connection:prepare(query)
+    assert(self.handle ~= nil, "Connection went away ...")
+
+    return {
+        handle = native.prepare(self.handle, query),
+        query = query
+    }
+end
+
+-- Whether prepare and execute work on this connection. Parameters are escaped in process,
+-- which is only safe for sqlite3 (see Connection:escapeSync)
+function Connection:canBindParams()
+    return self.type == "sqlite3" or self.type == "sqlite"
+end
+
+-- Returns the prepared statement for sql from the statement cache, preparing it on a miss
+function Connection:cachedStatement(query)
+    local cache = self.statementCache
+    if not cache then
+        cache = createStatementCache(self.statementCacheSize or 64)
+        self.statementCache = cache
+    end
+
+    local statement = cache:get(query)
+    if not statement then
+        statement = self:prepare(query)
+        cache:set(query, statement)
+    end
+    return statement
+end
+
+-- Returns {size, maxSize, hits, misses, evictions, hitRate} of the statement cache
+function Connection:getStatementCacheStats()
+    if not self.statementCache then
+        return createStatementCache(self.statementCacheSize or 64):getStats()
+    end
+    return self.statementCache:getStats()
+end
+
+-- Runs a prepared statement (or sql text) with the given parameters,
+-- ? placeholders take params[1], params[2], ... and :name placeholders params.name
+function Connection:execute(statement, params, options, callback)
+    options, callback = queryOptions(options, callback)
+
+    if type(statement) == "string" then
+        statement = self:cachedStatement(statement)
+    end
+
+    if self.cache then
+        if options.cache then
+            return self.cache:execute(self, statement, params, options, callback)
+        end
+        self.cache:observe(statement.query)
+    end
+
+    local q = native.execute(statement.handle, params, options.flags or 255, options)
+
+    return wrapQuery(q, statement.query, callback)
+end
+
 --Note: does not run parent constructor
 function Query:initialize(q)
     self.handle = q
     Handle.initialize(self)
 end
 
-function Query:fetch(callback)
+-- options:
+--   highWaterMark  pause (emitting "pause") after this many rows until Query:resume is called
+--   queueLimit     bytes of rows held while paused before the query fails with an error
+--                  whose code is "QUEUE_LIMIT" (default 16 MiB, 0 for no limit)
+function Query:fetch(callback, options)
     if callback then
         self:once("fetch", callback)
     end
 
-    native.fetch(self.handle)
+    native.fetch(self.handle, options)
+end
+
+-- Gives up on a query that did not complete yet, it fails with an error whose code is "CANCELLED".
+-- A query already running in the backend keeps its connection busy until it returns,
+-- its result is then discarded. Returns false when the query had completed already
+function Query:cancel()
+    return native.cancel(self.handle)
+end
+
+-- Holds back rows on the native side until resume is called. This only delays their
+-- delivery to lua, the backend can not be stopped: it keeps fetching and the held rows are
+-- copied into memory up to the queueLimit of Query:fetch, see queued and maxQueuedBytes
+-- of Query:getStats
+function Query:pause()
+    native.pause(self.handle)
+end
+
+-- Delivers the held back rows and continues fetching
+function Query:resume()
+    native.resume(self.handle)
+end
+
+-- Fetches the result in blocks of size rows, emitting "rows" with an array of rows and its length.
+-- With options.named every row is a table keyed by column name instead of an array,
+-- options.highWaterMark and options.queueLimit work as for Query:fetch
+function Query:fetchBatch(size, callback, options)
+    if callback then
+        self:on("rows", callback)
+    end
+
+    self:fetch(nil, {
+        batch = size,
+        named = options and options.named,
+        highWaterMark = options and options.highWaterMark,
+        queueLimit = options and options.queueLimit
+    })
+end
+
+-- Fetches the result emitting "row" with a single table keyed by column name
+function Query:fetchNamed(callback)
+    if callback then
+        self:on("row", callback)
+    end
+
+    self:fetch(nil, {named = true})
+end
+
+-- Collects the whole result in C into one array per column instead of creating lua values,
+-- callback receives an odbxuv.columnar Columnar once all rows were read (see "fetched")
+function Query:fetchColumnar(callback)
+    local Columnar = require "odbxuv.columnar".Columnar
+
+    self:once("columnar", function(data)
+        callback(Columnar.new(data, self:getAllColumnInfo()))
+    end)
+
+    self:fetch(nil, {columnar = true})
 end
 
 function Query:namedColumns(callback)
+    local names
     return function(...)
+        if not names then
+            names = {}
+            for i = 1, self:getColumnCount() do
+                names[i] = self:getColumnInfo(i)
+            end
+        end
+
         local row = {}
         for i, value in ipairs({...}) do
-            row[self:getColumnInfo(i)] = value
+            row[names[i]] = value
         end
         callback(row)
     end
 end
 
+-- Returns durations in milliseconds: queueWait, execution, fetch (query callback to last row)
+-- and callback (time spent in row handlers), the rows and bytes handed to lua,
+-- the rows and bytes held back by a pause (queued, queuedBytes, maxQueued, maxQueuedBytes) and
+-- the timestamps submitted, dispatched, done, firstRow, lastRow and closed (see odbxuv.now)
+function Query:getStats()
+    return native.queryStats(self.handle)
+end
+
 function Query:getColumnCount()
     return native.queryColumnCount(self.handle)
 end
@@ -189,6 +434,14 @@ return {
     Emitter = Emitter,
     Connection = Connection,
     Query = Query,
+    NULL = NULL,
+    BINARY_SAFE = native.BINARY_SAFE,
     createConnection = createConnection,
-    check = native.check
+    createPool = function(...) return require "odbxuv.pool".createPool(...) end,
+    createResultCache = function(...) return require "odbxuv.cache".createResultCache(...) end,
+    createRouter = function(...) return require "odbxuv.router".createRouter(...) end,
+    setEventSource = native.setEventSource,
+    handles = native.handles,
+    poolStats = native.poolStats,
+    now = native.now
 }
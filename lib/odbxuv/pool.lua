@@ -0,0 +1,357 @@
+local table = require "table"
+local timer = require "timer"
+
+local odbxuv = require "odbxuv"
+
+local now = odbxuv.now
+
+-- Hands out connected Connection objects, keeping at most max connections open
+local Pool = odbxuv.Emitter:extend()
+
+-- options:
+--   min             connections kept open even when idle (default 0)
+--   max             upper bound of open connections (default 10)
+--   acquireTimeout  ms a caller may wait for a connection, 0 waits forever (default 0)
+--   idleTimeout     ms after which idle connections above min are closed (default 30000)
+--   healthCheck     query run on connections that were idle for checkAfter ms before handing them out
+--   checkAfter      ms of idleness before the health check is run (default 5000)
+--   retryDelay      ms to wait before reconnecting after a failed connect (default 1000)
+function Pool:initialize(credentials, options)
+    options = options or {}
+
+    self.credentials = credentials
+    self.min = options.min or 0
+    self.max = options.max or 10
+    self.acquireTimeout = options.acquireTimeout or 0
+    self.idleTimeout = options.idleTimeout or 30000
+    self.healthCheck = options.healthCheck
+    self.checkAfter = options.checkAfter or 5000
+    self.retryDelay = options.retryDelay or 1000
+
+    assert(self.max > 0 and self.min <= self.max, "Pool needs 0 <= min <= max and max > 0")
+
+    self.size = 0      -- open and opening connections
+    self.opening = 0
+    self.destroying = 0 -- connections being disconnected, still counted in size
+    self.inUse = 0
+    self.idle = {}     -- stack of {connection = ..., since = ...}, most recently used on top
+    self.waiters = {}  -- FIFO of {callback = ..., since = ..., timer = ...}
+    self.waitHead = 1
+    self.waitTail = 0
+    self.waiting = 0   -- waiters in the FIFO that did not time out
+
+    self.counters = {
+        created = 0,
+        destroyed = 0,
+        acquired = 0,
+        timeouts = 0,
+        errors = 0,
+        waited = 0,
+        waitTime = 0,
+        maxWaitTime = 0
+    }
+
+    self.reaper = timer.setInterval(math.max(1000, math.floor(self.idleTimeout / 2)), function()
+        self:reapIdle()
+    end)
+    -- The reaper alone does not keep the loop running
+    if self.reaper.unref then
+        self.reaper:unref()
+    end
+
+    self:fill()
+end
+
+-- Connect failures are passed to the oldest waiter, so "error" is only emitted
+-- to listeners there are instead of raising without any
+function Pool:missingHandlerType(name, ...)
+end
+
+function Pool:waiterCount()
+    return self.waiting
+end
+
+function Pool:pushWaiter(waiter)
+    self.waitTail = self.waitTail + 1
+    self.waiters[self.waitTail] = waiter
+    self.waiting = self.waiting + 1
+end
+
+-- Returns the oldest waiter that did not time out yet
+function Pool:shiftWaiter()
+    while self.waitHead <= self.waitTail do
+        local waiter = self.waiters[self.waitHead]
+        self.waiters[self.waitHead] = nil
+        self.waitHead = self.waitHead + 1
+
+        if not waiter.cancelled then
+            if waiter.timer then
+                timer.clearTimer(waiter.timer)
+            end
+            self.waiting = self.waiting - 1
+            return waiter
+        end
+    end
+end
+
+-- Opens connections until min is reached or every waiter has one on the way
+function Pool:fill()
+    if self.closed then
+        return
+    end
+
+    while self.size < self.max and (self.size < self.min or self.opening < self:waiterCount()) do
+        self:open()
+    end
+end
+
+function Pool:open()
+    local connection = odbxuv.Connection:new()
+    local connected = false
+
+    self.size = self.size + 1
+    self.opening = self.opening + 1
+
+    connection:on("error", function(err)
+        self.counters.errors = self.counters.errors + 1
+
+        if not connected then
+            self.opening = self.opening - 1
+            self:forget(connection, true)
+
+            -- Let the oldest waiter know instead of retrying forever on its behalf
+            local waiter = self:shiftWaiter()
+            if waiter then
+                waiter.callback(err)
+            end
+            self:emit("error", err)
+            return
+        end
+
+        -- Broken connections are dropped and replaced
+        if connection.pooled == "destroyed" then
+            self:forget(connection)
+        elseif connection.pooled == "idle" then
+            self:removeIdle(connection)
+            self:destroy(connection)
+        else
+            connection.broken = true
+        end
+    end)
+
+    connection:connect(self.credentials)
+    connection:once("connect", function()
+        connected = true
+        self.opening = self.opening - 1
+        self.counters.created = self.counters.created + 1
+        self:release(connection, true)
+    end)
+end
+
+-- Forgets a connection that is no longer usable
+function Pool:forget(connection, failed)
+    if connection.pooled == "forgotten" then
+        return
+    end
+
+    if connection.pooled == "destroyed" then
+        self.destroying = self.destroying - 1
+    end
+    connection.pooled = "forgotten"
+    self.size = self.size - 1
+    self.counters.destroyed = self.counters.destroyed + 1
+    if connection.handle then
+        connection:close()
+    end
+
+    if failed then
+        timer.setTimeout(self.retryDelay, function()
+            self:fill()
+        end)
+    else
+        self:fill()
+    end
+end
+
+function Pool:destroy(connection)
+    connection.pooled = "destroyed"
+    self.destroying = self.destroying + 1
+
+    -- Connections that already lost their link can not be disconnected
+    local ok = pcall(connection.disconnect, connection, function()
+        self:forget(connection)
+    end)
+
+    if not ok then
+        self:forget(connection)
+    end
+end
+
+function Pool:removeIdle(connection)
+    for i, entry in ipairs(self.idle) do
+        if entry.connection == connection then
+            table.remove(self.idle, i)
+            return
+        end
+    end
+end
+
+function Pool:handOut(connection, waiter)
+    local waited = now() - waiter.since
+    local counters = self.counters
+
+    counters.acquired = counters.acquired + 1
+    counters.waited = counters.waited + 1
+    counters.waitTime = counters.waitTime + waited
+    counters.maxWaitTime = math.max(counters.maxWaitTime, waited)
+
+    connection.pooled = "used"
+    self.inUse = self.inUse + 1
+    waiter.callback(nil, connection)
+end
+
+-- Calls callback(err, connection) once a healthy connection is available
+function Pool:acquire(callback)
+    if self.closed then
+        return callback("Pool is closed")
+    end
+
+    local waiter = {callback = callback, since = now()}
+
+    local entry = table.remove(self.idle)
+    if entry then
+        return self:check(entry, waiter)
+    end
+
+    if self.acquireTimeout > 0 then
+        waiter.timer = timer.setTimeout(self.acquireTimeout, function()
+            waiter.cancelled = true
+            self.waiting = self.waiting - 1
+            self.counters.timeouts = self.counters.timeouts + 1
+            callback("Timed out waiting for a connection after " .. self.acquireTimeout .. "ms")
+        end)
+    end
+
+    self:pushWaiter(waiter)
+    self:fill()
+end
+
+-- Runs the health check on connections that sat idle for a while before handing them out
+function Pool:check(entry, waiter)
+    local connection = entry.connection
+
+    if not self.healthCheck or now() - entry.since < self.checkAfter then
+        return self:handOut(connection, waiter)
+    end
+
+    connection.pooled = "checking"
+    connection:query(self.healthCheck, function(err, query)
+        query:close()
+
+        if err then
+            connection.broken = true
+            self:destroy(connection)
+            return self:acquire(waiter.callback)
+        end
+
+        self:handOut(connection, waiter)
+    end)
+end
+
+-- Returns a connection acquired from the pool
+function Pool:release(connection, fresh)
+    if not fresh then
+        assert(connection.pooled == "used", "Connection was not acquired from this pool")
+        self.inUse = self.inUse - 1
+    end
+
+    if connection.broken or self.closed then
+        return self:destroy(connection)
+    end
+
+    local waiter = self:shiftWaiter()
+    if waiter then
+        return self:handOut(connection, waiter)
+    end
+
+    connection.pooled = "idle"
+    self.idle[#self.idle+1] = {connection = connection, since = now()}
+end
+
+-- Runs Connection:transaction on a connection of the pool, it is released once the
+-- transaction committed or rolled back
+function Pool:transaction(fn, callback)
+    self:acquire(function(err, connection)
+        if err then
+            if callback then
+                callback(err)
+            end
+            return
+        end
+
+        connection:transaction(fn, function(...)
+            self:release(connection)
+            if callback then
+                callback(...)
+            end
+        end)
+    end)
+end
+
+-- Closes connections above min that have been idle for longer than idleTimeout
+function Pool:reapIdle()
+    local deadline = now() - self.idleTimeout
+
+    -- The oldest entries are at the bottom of the stack. Connections are only gone once
+    -- disconnected, so the ones still being destroyed do not count towards min
+    while #self.idle > 0 and self.size - self.destroying > self.min and self.idle[1].since < deadline do
+        local entry = table.remove(self.idle, 1)
+        self:destroy(entry.connection)
+    end
+end
+
+function Pool:getStats()
+    local counters = self.counters
+    return {
+        size = self.size,
+        opening = self.opening,
+        inUse = self.inUse,
+        idle = #self.idle,
+        waiters = self:waiterCount(),
+        created = counters.created,
+        destroyed = counters.destroyed,
+        acquired = counters.acquired,
+        timeouts = counters.timeouts,
+        errors = counters.errors,
+        waitTime = counters.waitTime,
+        maxWaitTime = counters.maxWaitTime,
+        averageWaitTime = counters.waited > 0 and counters.waitTime / counters.waited or 0
+    }
+end
+
+-- Stops handing out connections and closes the idle ones, used ones are closed on release
+function Pool:close()
+    self.closed = true
+    timer.clearTimer(self.reaper)
+
+    local waiter = self:shiftWaiter()
+    while waiter do
+        waiter.callback("Pool is closed")
+        waiter = self:shiftWaiter()
+    end
+
+    local idle = self.idle
+    self.idle = {}
+    for _, entry in ipairs(idle) do
+        self:destroy(entry.connection)
+    end
+end
+
+local function createPool(credentials, options)
+    return Pool:new(credentials, options)
+end
+
+return {
+    Pool = Pool,
+    createPool = createPool
+}
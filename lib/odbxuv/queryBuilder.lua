@@ -2,6 +2,7 @@
 local table = require "table"
 local ibmt = require "ibmt"
 
+local native = require "opendbxuv"
 local odbxuv = require "odbxuv"
 
 local QueryBuilder = odbxuv.Emitter:extend()
@@ -63,6 +64,74 @@ function QueryBuilder:bind(var, value)
     self.whereCondition.vars[var] = value
 end
 
+-- Emit placeholders and collect the values as parameters instead of escaping them,
+-- finalize then calls back with (err, sql, params) for Connection:execute
+function QueryBuilder:parameterize()
+    self.params = {}
+end
+
+-- finalize then hands out the sql in a native buffer (see native.buffer) instead of a string,
+-- Connection:query submits it without another copy
+function QueryBuilder:buffered()
+    self.useBuffer = true
+end
+
+-- Collects the fragments of the finalized sql in order, one per line. Buffered, every fragment
+-- goes straight into the native buffer unless an earlier one still waits for Connection:escape,
+-- only those after it are held until it arrives
+local Writer = {}
+Writer.__index = Writer
+
+local function createWriter(buffered)
+    return setmetatable({
+        buffer = buffered and native.buffer() or nil,
+        parts = {},     -- fragments not in the buffer yet, false while one is escaped
+        head = 1,       -- first part not in the buffer
+        tail = 0,
+        written = 0
+    }, Writer)
+end
+
+function Writer:flush()
+    local parts = self.parts
+    while self.head <= self.tail and parts[self.head] do
+        native.bufferAppend(self.buffer, self.written > 0 and "\n" or "", parts[self.head])
+        parts[self.head] = nil
+        self.head = self.head + 1
+        self.written = self.written + 1
+    end
+end
+
+-- Appends a fragment, without one the slot is reserved for Writer:set
+function Writer:add(fragment)
+    if self.buffer and fragment and self.head > self.tail then
+        native.bufferAppend(self.buffer, self.written > 0 and "\n" or "", fragment)
+        self.written = self.written + 1
+        self.head = self.head + 1
+        self.tail = self.tail + 1
+        return self.tail
+    end
+
+    self.tail = self.tail + 1
+    self.parts[self.tail] = fragment or false
+    return self.tail
+end
+
+function Writer:set(slot, fragment)
+    self.parts[slot] = fragment
+    if self.buffer then
+        self:flush()
+    end
+end
+
+-- The finished sql, a string or the buffer
+function Writer:result()
+    if self.buffer then
+        return self.buffer
+    end
+    return table.concat(self.parts, "\n", 1, self.tail)
+end
+
 function QueryBuilder:limit(limit)
     self.limited = limit
 end
@@ -107,6 +176,10 @@ function QueryBuilder:escapeValue(value, callback)
     if type(value) == "number" then
         callback(nil, value)
     else
+        local escaped = self.connection:escapeSync(value)
+        if escaped then
+            return callback(nil, escaped)
+        end
         self.connection:escape(value, callback)
     end
 end
@@ -115,6 +188,10 @@ function QueryBuilder:quoteValue(value, callback)
     if value == self.connection.NULL then
         return callback(nil, "NULL")
     end
+    if self.params then
+        self.params[#self.params+1] = value
+        return callback(nil, "?")
+    end
     self:escapeValue(value, function(err, data)
         callback(err, type(data) == "string" and "'"..data.."'" or data)
     end)
@@ -122,6 +199,15 @@ end
 
 function QueryBuilder:createEscapedWhereTree(tree, cb)
     local condition = tree.tree
+
+    -- The :variables are bound by name
+    if self.params then
+        for variable, value in pairs(tree.vars or {}) do
+            self.params[variable] = value
+        end
+        return cb(nil, condition)
+    end
+
     local task = ibmt.create()
 
     task:push()
@@ -133,7 +219,10 @@ function QueryBuilder:createEscapedWhereTree(tree, cb)
                 return task:cancel(err)
             end
 
-            condition = condition:gsub(":"..variable, val)
+            -- Whole names only, :id must not touch :idx
+            condition = condition:gsub(":"..variable:gsub("%W", "%%%0").."%f[^%w_]", function()
+                return val
+            end)
             task:pop()
         end)
     end
@@ -146,40 +235,39 @@ end
 
 function QueryBuilder:finalizeInsert(cb)
     local task = ibmt.create()
-    local value = {}
-    value[1] = "INSERT " .. (self.ignore == true and "IGNORE " or "") .. "INTO"
-    value[2] = self:escapeTableName(self.from[1])
-    value[3] = "(".. self:createEscapedFieldList(self.what) .. ")"
-    value[4] = "VALUES "
+    local out = createWriter(self.useBuffer)
+    out:add("INSERT " .. (self.ignore == true and "IGNORE " or "") .. "INTO")
+    out:add(self:escapeTableName(self.from[1]))
+    out:add("(".. self:createEscapedFieldList(self.what) .. ")")
+    out:add("VALUES ")
     
     task:push()
     local first = true
     for _, row in pairs(self.rows) do
-        value[#value+1] = first and "(" or ",("
+        out:add(first and "(" or ",(")
 
             local first2 = true
             for __, cell in pairs(row) do
-                local dest = #value+1
+                local dest = out:add()
                 local wasFirst = first2
-                value[dest] = "<ESCAPING>"
                 task:push()
                 self:quoteValue(cell, function(err, val)
                     if err then
                         return task:cancel(err)
                     end
-                    value[dest] = wasFirst and "  "..val or ", "..val
+                    out:set(dest, wasFirst and "  "..val or ", "..val)
                     task:pop()
                 end)
                 first2 = false
             end
-        value[#value+1] = ")"
+        out:add(")")
         first = false
     end
-    value[#value+1] = ";"
+    out:add(";")
     
     if cb then
         task:on("finish", function()
-            cb(nil, table.concat(value, "\n"))
+            cb(nil, out:result(), self.params)
         end)
 
         task:on("error", function(...)
@@ -194,42 +282,43 @@ end
 
 function QueryBuilder:finalizeSelect(cb)
     local task = ibmt.create()
-    local value = {}
-    value[1] = "SELECT ".. self:createEscapedFieldList(self.what)
-    value[2] = "FROM "  .. self:createEscapedTableList(self.from)
+    local out = createWriter(self.useBuffer)
+    out:add("SELECT ".. self:createEscapedFieldList(self.what))
+    out:add("FROM "  .. self:createEscapedTableList(self.from))
     
     task:push()
     
     if self.whereCondition then
         task:push()
+        local whereIdx = out:add()
         self:createEscapedWhereTree(self.whereCondition, function(err, data)
             if err then
-                task:error(err)
+                return task:cancel(err)
             end
-            value[3] = "WHERE " .. data
+            out:set(whereIdx, "WHERE " .. data)
             task:pop()
         end)
     else
-        value[3] = ""
+        out:add("")
     end
 
     if self.order then
-        value[4] = "ORDER BY "
+        out:add("ORDER BY "
         ..(self.order.raw and self.order.raw or self:createEscapedFieldList(self.order.fields))
-        ..(self.order.direction and "\n" .. self:createOrderDirection(self.order.direction) or "")
+        ..(self.order.direction and "\n" .. self:createOrderDirection(self.order.direction) or ""))
     else
-        value[4] = ""
+        out:add("")
     end
 
     if self.limited then
-        value[5] = "LIMIT "..self.limited
+        out:add("LIMIT "..self.limited)
     else
-        value[5] = ""
+        out:add("")
     end
 
     if cb then
         task:on("finish", function()
-            cb(nil, table.concat(value, "\n"))
+            cb(nil, out:result(), self.params)
         end)
         task:on("error", function(...)
             cb(...)
@@ -243,9 +332,9 @@ end
 
 function QueryBuilder:finalizeUpdate(cb)
     local task = ibmt.create()
-    local value = {}
-    value[1] = "UPDATE ".. self:createEscapedTableList(self.from)
-    value[2] = "SET "
+    local out = createWriter(self.useBuffer)
+    out:add("UPDATE ".. self:createEscapedTableList(self.from))
+    out:add("SET ")
 
     task:push()
 
@@ -253,16 +342,15 @@ function QueryBuilder:finalizeUpdate(cb)
     for _, row in pairs(self.rows) do
         local first2 = true
         for key, cell in pairs(row) do
-            local dest = #value+1
+            local dest = out:add()
             local wasFirst = first2
-            value[dest] = "<ESCAPING>"
             task:push()
             self:quoteValue(cell, function(err, val)
                 if err then
                     return task:cancel(err)
                 end
                 val = self:escapeFieldName(key) .." = "..val
-                value[dest] = wasFirst and "  "..val or ", "..val
+                out:set(dest, wasFirst and "  "..val or ", "..val)
                 task:pop()
             end)
             first2 = false
@@ -271,30 +359,29 @@ function QueryBuilder:finalizeUpdate(cb)
 
     if self.whereCondition then
         task:push()
-        local whereIdx = #value+1
-        value[whereIdx] = "WHERE <CONDITION>"
+        local whereIdx = out:add()
         self:createEscapedWhereTree(self.whereCondition, function(err, data)
             if err then
                 return task:cancel(err)
             end
-            value[whereIdx] = "WHERE " .. data
+            out:set(whereIdx, "WHERE " .. data)
             task:pop()
         end)
     end
 
     if self.order then
-        value[#value+1] = "ORDER BY "
+        out:add("ORDER BY "
         ..(self.order.raw and self.order.raw or self:createEscapedFieldList(self.order.fields))
-        ..(self.order.direction and "\n" .. self:createOrderDirection(self.order.direction) or "")
+        ..(self.order.direction and "\n" .. self:createOrderDirection(self.order.direction) or ""))
     end
 
     if self.limited then
-        value[#value+1] = "LIMIT "..self.limited
+        out:add("LIMIT "..self.limited)
     end
 
     if cb then
         task:on("finish", function()
-            cb(nil, table.concat(value, "\n"))
+            cb(nil, out:result(), self.params)
         end)
         task:on("error", function(...)
             cb(...)
@@ -306,6 +393,112 @@ function QueryBuilder:finalizeUpdate(cb)
     return task
 end
 
+-- Finalizes the parameterized query and runs it on the connection
+function QueryBuilder:execute(options, callback)
+    if type(options) == "function" then
+        callback = options
+        options = nil
+    end
+
+    if not self.params then
+        self:parameterize()
+    end
+    -- Statements are prepared from the sql text
+    self.useBuffer = nil
+
+    return self:finalize(function(err, sql, params)
+        if err then
+            if callback then
+                callback(err)
+            end
+            return
+        end
+
+        self.connection:execute(sql, params, options, callback)
+    end)
+end
+
+-- Finalizes the query into a native buffer and runs it on the connection like Connection:query,
+-- for large generated statements such as multi row inserts
+function QueryBuilder:query(options, callback)
+    if type(options) == "function" then
+        callback = options
+        options = nil
+    end
+
+    self:buffered()
+
+    return self:finalize(function(err, buffer)
+        if err then
+            if callback then
+                callback(err)
+            end
+            return
+        end
+
+        self.connection:query(buffer, options, callback)
+    end)
+end
+
+-- A finalized query whose sql was split at its placeholders once,
+-- every execution only splices in the values
+local Template = {}
+Template.__index = Template
+
+-- Compiled values and :name bindings, overridden by vars (by name or position)
+function Template:bindParams(vars)
+    local params = {}
+    for k, v in pairs(self.values) do
+        params[k] = v
+    end
+    for k, v in pairs(vars or {}) do
+        params[k] = v
+    end
+    return params
+end
+
+-- Runs the template like Connection:execute
+function Template:execute(vars, options, callback)
+    if type(vars) == "function" then
+        callback, vars, options = vars, nil, nil
+    elseif type(options) == "function" then
+        callback, options = options, nil
+    end
+
+    return self.connection:execute(self.statement, self:bindParams(vars), options, callback)
+end
+
+-- Returns the sql with the values spliced in
+function Template:render(vars)
+    return native.format(self.statement.handle, self:bindParams(vars))
+end
+
+-- Finalizes the query once into a reusable Template, values given to values/set/bind
+-- become its defaults. callback(err, template) is optional, the template is also
+-- returned when finalizing did not have to wait
+function QueryBuilder:compile(callback)
+    local template
+
+    self:parameterize()
+    self.useBuffer = nil
+    self:finalize(function(err, sql, params)
+        if not err then
+            template = setmetatable({
+                connection = self.connection,
+                sql = sql,
+                statement = self.connection:prepare(sql),
+                values = params
+            }, Template)
+        end
+
+        if callback then
+            callback(err, template)
+        end
+    end)
+
+    return template
+end
+
 local MySQLQueryBuilder = QueryBuilder:extend()
 
 function MySQLQueryBuilder:escapeFieldName(field)
@@ -326,5 +519,6 @@ end
 
 return {
     QueryBuilder= QueryBuilder,
+    Template = Template,
     createQueryBuilder = createQueryBuilder
 }
@@ -0,0 +1,308 @@
+local timer = require "timer"
+
+local odbxuv = require "odbxuv"
+
+local now = odbxuv.now
+
+-- Leading comments do not decide the statement type
+local function stripComments(sql)
+    local rest = sql
+    while true do
+        local stripped = rest:gsub("^%s+", ""):gsub("^%-%-[^\n]*", ""):gsub("^/%*.-%*/", "")
+        if stripped == rest then
+            return rest
+        end
+        rest = stripped
+    end
+end
+
+local READ_VERBS = {
+    SELECT = true,
+    SHOW = true,
+    EXPLAIN = true,
+    DESCRIBE = true,
+    DESC = true,
+    WITH = true
+}
+
+-- True for statements a replica can answer
+local function isRead(sql)
+    local verb = stripComments(sql):match("^%(?%s*(%a+)")
+    if not verb or not READ_VERBS[verb:upper()] then
+        return false
+    end
+
+    -- Locking reads and CTEs feeding a write belong to the primary
+    local upper = sql:upper()
+    return not (upper:find("FOR%s+UPDATE") or upper:find("LOCK%s+IN%s+SHARE%s+MODE")
+        or upper:find("%)%s*INSERT%s") or upper:find("%)%s*UPDATE%s") or upper:find("%)%s*DELETE%s"))
+end
+
+-- Sends writes and transactions to a primary and reads to replicas.
+-- Targets are Connections or Pools
+local Router = odbxuv.Emitter:extend()
+
+-- options:
+--   ejectTime    ms an unhealthy target is left out before it is tried again (default 5000)
+--   maxFailures  consecutive failed queries that eject a target (default 3)
+function Router:initialize(primary, replicas, options)
+    options = options or {}
+
+    self.ejectTime = options.ejectTime or 5000
+    self.maxFailures = options.maxFailures or 3
+    self.targets = {}
+    self.next = 1   -- rotates the replica tried first among equally loaded ones
+
+    self.primary = self:addTarget(primary, "primary")
+    self.replicas = {}
+    for i, replica in ipairs(replicas or {}) do
+        self.replicas[i] = self:addTarget(replica, "replica" .. i)
+    end
+end
+
+function Router:addTarget(backend, name)
+    local target = {
+        backend = backend,
+        name = name,
+        pooled = backend.acquire ~= nil,
+        healthy = true,
+        outstanding = 0,
+        queries = 0,
+        errors = 0,
+        failures = 0,   -- consecutive
+        ejections = 0,
+        time = 0,
+        maxTime = 0
+    }
+
+    backend:on("error", function(err)
+        self:eject(target, err)
+    end)
+    if not target.pooled then
+        backend:on("disconnect", function()
+            self:eject(target, "disconnected")
+        end)
+    end
+
+    self.targets[#self.targets+1] = target
+    return target
+end
+
+-- Leaves the target out for ejectTime ms
+function Router:eject(target, reason)
+    if not target.healthy then
+        return
+    end
+
+    target.healthy = false
+    target.ejections = target.ejections + 1
+    self:emit("eject", target.name, reason)
+
+    timer.setTimeout(self.ejectTime, function()
+        target.healthy = true
+        target.failures = 0
+        self:emit("readmit", target.name)
+    end)
+end
+
+-- The healthy replica with the fewest outstanding queries, the primary when there is none
+function Router:pick(read)
+    if not read then
+        return self.primary
+    end
+
+    local best
+    local count = #self.replicas
+    for i = 0, count - 1 do
+        local target = self.replicas[(self.next + i - 1) % count + 1]
+        if target.healthy and (not best or target.outstanding < best.outstanding) then
+            best = target
+        end
+    end
+    self.next = self.next % math.max(count, 1) + 1
+
+    return best or self.primary
+end
+
+-- Runs the statement on target, counting it until its query callback
+function Router:run(target, sql, params, options, callback)
+    local started = now()
+    local finished = false
+
+    target.outstanding = target.outstanding + 1
+    target.queries = target.queries + 1
+
+    local function done(err, query, ...)
+        -- Query callbacks run again for errors while fetching
+        if finished then
+            if callback then callback(err, query, ...) end
+            return
+        end
+        finished = true
+
+        local elapsed = now() - started
+        target.outstanding = target.outstanding - 1
+        target.time = target.time + elapsed
+        target.maxTime = math.max(target.maxTime, elapsed)
+
+        if err then
+            target.errors = target.errors + 1
+            target.failures = target.failures + 1
+            if target.failures >= self.maxFailures then
+                self:eject(target, err)
+            end
+        else
+            target.failures = 0
+        end
+
+        if callback then
+            callback(err, query, ...)
+        end
+    end
+
+    local function submit(connection, release)
+        -- Pooled connections go back once the result was read or the query failed,
+        -- closing the query is the fallback for results that are never fetched
+        local released = false
+        local function releaseOnce()
+            if release and not released then
+                released = true
+                release()
+            end
+        end
+
+        local function finish(err, ...)
+            if err then
+                releaseOnce()
+            end
+            done(err, ...)
+        end
+
+        local ok, err = pcall(function()
+            local query
+            if params then
+                query = connection:execute(sql, params, options, finish)
+            else
+                query = connection:query(sql, options, finish)
+            end
+
+            if release then
+                query:once("fetched", releaseOnce)
+                query:once("close", releaseOnce)
+            end
+        end)
+
+        if not ok then
+            releaseOnce()
+            done(err)
+        end
+    end
+
+    if not target.pooled then
+        return submit(target.backend)
+    end
+
+    target.backend:acquire(function(err, connection)
+        if err then
+            return done(err)
+        end
+
+        submit(connection, function()
+            target.backend:release(connection)
+        end)
+    end)
+end
+
+-- Same as Connection:query, but the result arrives through callback only.
+-- options.route = "read" or "write" overrides the classification of the sql
+function Router:query(sql, options, callback)
+    if type(options) == "function" then
+        callback = options
+        options = nil
+    end
+
+    if type(options) ~= "table" then
+        options = {flags = options}
+    end
+
+    local read
+    if options.route then
+        read = options.route == "read"
+    else
+        read = isRead(sql)
+    end
+
+    self:run(self:pick(read), sql, nil, options, callback)
+end
+
+-- Same as Connection:execute with sql text
+function Router:execute(sql, params, options, callback)
+    if type(options) == "function" then
+        callback = options
+        options = nil
+    end
+
+    options = options or {}
+    if type(options) ~= "table" then
+        options = {flags = options}
+    end
+
+    local read
+    if options.route then
+        read = options.route == "read"
+    else
+        read = isRead(sql)
+    end
+
+    self:run(self:pick(read), sql, params or {}, options, callback)
+end
+
+-- Transactions always run on the primary
+function Router:transaction(fn, callback)
+    local target = self.primary
+    local started = now()
+
+    target.outstanding = target.outstanding + 1
+    target.queries = target.queries + 1
+
+    target.backend:transaction(fn, function(err)
+        local elapsed = now() - started
+        target.outstanding = target.outstanding - 1
+        target.time = target.time + elapsed
+        target.maxTime = math.max(target.maxTime, elapsed)
+        if err then
+            target.errors = target.errors + 1
+        end
+
+        if callback then
+            callback(err)
+        end
+    end)
+end
+
+-- Per target {healthy, outstanding, queries, errors, ejections, meanLatency, maxLatency}, latencies in ms
+function Router:getStats()
+    local stats = {}
+    for _, target in ipairs(self.targets) do
+        stats[target.name] = {
+            healthy = target.healthy,
+            outstanding = target.outstanding,
+            queries = target.queries,
+            errors = target.errors,
+            ejections = target.ejections,
+            meanLatency = target.queries > 0 and target.time / target.queries or 0,
+            maxLatency = target.maxTime
+        }
+    end
+    return stats
+end
+
+local function createRouter(primary, replicas, options)
+    return Router:new(primary, replicas, options)
+end
+
+return {
+    Router = Router,
+    isRead = isRead,
+    createRouter = createRouter
+}
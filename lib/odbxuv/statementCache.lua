@@ -0,0 +1,71 @@
+-- Bounded LRU of prepared statements by sql text
+local StatementCache = {}
+StatementCache.__index = StatementCache
+
+local function createStatementCache(size)
+    return setmetatable({
+        size = size,
+        entries = {},   -- sql -> node {sql, statement, prev, next}, head is the least recently used
+        count = 0,
+        hits = 0,
+        misses = 0,
+        evictions = 0
+    }, StatementCache)
+end
+
+function StatementCache:unlink(node)
+    if node.prev then node.prev.next = node.next else self.head = node.next end
+    if node.next then node.next.prev = node.prev else self.tail = node.prev end
+    node.prev, node.next = nil, nil
+end
+
+function StatementCache:append(node)
+    node.prev = self.tail
+    if self.tail then self.tail.next = node else self.head = node end
+    self.tail = node
+end
+
+function StatementCache:get(sql)
+    local node = self.entries[sql]
+    if not node then
+        self.misses = self.misses + 1
+        return
+    end
+
+    self.hits = self.hits + 1
+    self:unlink(node)
+    self:append(node)
+    return node.statement
+end
+
+function StatementCache:set(sql, statement)
+    local node = {sql = sql, statement = statement}
+    self.entries[sql] = node
+    self.count = self.count + 1
+    self:append(node)
+
+    if self.count > self.size then
+        local oldest = self.head
+        self:unlink(oldest)
+        self.entries[oldest.sql] = nil
+        self.count = self.count - 1
+        self.evictions = self.evictions + 1
+    end
+end
+
+function StatementCache:getStats()
+    local lookups = self.hits + self.misses
+    return {
+        size = self.count,
+        maxSize = self.size,
+        hits = self.hits,
+        misses = self.misses,
+        evictions = self.evictions,
+        hitRate = lookups > 0 and self.hits / lookups or 0
+    }
+end
+
+return {
+    StatementCache = StatementCache,
+    createStatementCache = createStatementCache
+}
@@ -0,0 +1,306 @@
+local table = require "table"
+
+local native = require "opendbxuv"
+local odbxuv = require "odbxuv"
+
+local function trim(sql)
+    return (sql:gsub("[%s;]+$", ""))
+end
+
+-- Runs queries inside BEGIN/COMMIT on a single connection, nested ones inside savepoints.
+-- BEGIN is only sent along with the first statement, and statements queued with
+-- Transaction:batch go out together with it and the COMMIT. Connections opened with
+-- credentials.multiStatements send such a group as one query, others one query per statement.
+-- Separate queries keep running after one of them failed, so there the COMMIT is only
+-- sent once the statements before it succeeded.
+local Transaction = odbxuv.Emitter:extend()
+
+function Transaction:initialize(connection, parent)
+    self.connection = connection
+    self.parent = parent
+    self.root = parent and parent.root or self
+
+    if parent then
+        self.root.savepoints = self.root.savepoints + 1
+        local name = "odbxuv_savepoint_" .. self.root.savepoints
+        self.beginSql = {"SAVEPOINT " .. name}
+        self.commitSql = {"RELEASE SAVEPOINT " .. name}
+        self.rollbackSql = {"ROLLBACK TO SAVEPOINT " .. name, "RELEASE SAVEPOINT " .. name}
+    else
+        self.savepoints = 0
+        self.beginSql = {"BEGIN"}
+        self.commitSql = {"COMMIT"}
+        self.rollbackSql = {"ROLLBACK"}
+    end
+
+    self.statements = {}  -- batched statements not sent yet
+    self.pending = 0      -- sent groups, queries and savepoints that did not complete
+    self.started = false  -- BEGIN or SAVEPOINT was sent
+end
+
+-- Sends a group of statements, callback(err) once all of them ran
+function Transaction:send(statements, callback)
+    if #statements == 0 then
+        return callback()
+    end
+
+    local connection = self.connection
+    local remaining = connection.multiStatements and 1 or #statements
+    local failed
+
+    local function done(err, query)
+        if query then
+            query:close()
+        end
+
+        failed = failed or err
+        remaining = remaining - 1
+        if remaining == 0 then
+            callback(failed)
+        end
+    end
+
+    if connection.multiStatements then
+        connection:query(table.concat(statements, ";\n"), done)
+    else
+        for _, sql in ipairs(statements) do
+            connection:query(sql, done)
+        end
+    end
+end
+
+-- Counts an operation as pending, the returned function completes it
+function Transaction:track()
+    self.pending = self.pending + 1
+
+    local completed = false
+    return function(err)
+        -- Query callbacks run again for errors while fetching
+        if completed then
+            return
+        end
+        completed = true
+
+        self.pending = self.pending - 1
+        if err then
+            self.failed = self.failed or err
+        end
+        self:settle()
+    end
+end
+
+-- Returns the unsent statements, prefixed with BEGIN when not started yet
+function Transaction:take()
+    local statements = self.statements
+    self.statements = {}
+
+    if not self.started and #statements > 0 then
+        self.started = true
+        for i, sql in ipairs(self.beginSql) do
+            table.insert(statements, i, sql)
+        end
+    end
+
+    return statements
+end
+
+-- Sends the batched statements, or BEGIN alone when nothing was batched before the first query
+function Transaction:flush()
+    if not self.started and #self.statements == 0 then
+        self.started = true
+        return self:send(self.beginSql, self:track())
+    end
+
+    local statements = self:take()
+    if #statements > 0 then
+        self:send(statements, self:track())
+    end
+end
+
+-- Queues a statement whose result is not needed, it is sent with the next query or the commit.
+-- sql is sql text or a statement returned by Connection:prepare, params are spliced in like Connection:execute
+function Transaction:batch(sql, params)
+    assert(not self.finishing, "Transaction:batch after the transaction finished")
+
+    if params then
+        local statement = type(sql) == "table" and sql or self.connection:cachedStatement(sql)
+        sql = native.format(statement.handle, params)
+    elseif type(sql) == "table" then
+        sql = sql.query
+    end
+
+    self.statements[#self.statements+1] = trim(sql)
+end
+
+-- Wraps a query callback, the query counts as pending until its callback returned
+function Transaction:wrap(callback)
+    local done = self:track()
+
+    return function(err, ...)
+        if callback then
+            callback(err, ...)
+        end
+        done(err)
+    end
+end
+
+-- Same as Connection:query, runs after the statements batched so far
+function Transaction:query(query, options, callback)
+    if type(options) == "function" then
+        callback = options
+        options = nil
+    end
+
+    if self.failed then
+        if callback then
+            callback(self.failed)
+        end
+        return
+    end
+
+    self:flush()
+    return self.connection:query(query, options, self:wrap(callback))
+end
+
+-- Same as Connection:execute, runs after the statements batched so far
+function Transaction:execute(statement, params, options, callback)
+    if type(options) == "function" then
+        callback = options
+        options = nil
+    end
+
+    if self.failed then
+        if callback then
+            callback(self.failed)
+        end
+        return
+    end
+
+    self:flush()
+    return self.connection:execute(statement, params, options, self:wrap(callback))
+end
+
+-- Runs fn(tx, done) inside a savepoint, an error only rolls back to the savepoint.
+-- callback(err) is called after the savepoint was released or rolled back
+function Transaction:savepoint(fn, callback)
+    assert(not self.finishing, "Transaction:savepoint after the transaction finished")
+
+    -- Everything queued so far has to precede the savepoint
+    self:flush()
+
+    local savepoint = Transaction:new(self.connection, self)
+    local done = self:track()
+
+    savepoint:run(fn, function(err)
+        if callback then
+            callback(err)
+        end
+        done()
+    end)
+
+    return savepoint
+end
+
+function Transaction:run(fn, callback)
+    local called = false
+    local function done(err)
+        if called then
+            return
+        end
+        called = true
+
+        if err then
+            self.failed = self.failed or err
+        end
+        self.finishing = true
+        self:settle()
+    end
+
+    self.callback = callback
+
+    local ok, err = pcall(fn, self, done)
+    if not ok then
+        done(err)
+    end
+end
+
+-- Commits or rolls back once fn called done and every pending operation completed
+function Transaction:settle()
+    if not self.finishing or self.pending > 0 or self.settled then
+        return
+    end
+    self.settled = true
+
+    if self.failed then
+        self.statements = {}
+        if not self.started then
+            return self:finish(self.failed)
+        end
+        return self:send(self.rollbackSql, function()
+            self:finish(self.failed)
+        end)
+    end
+
+    local statements = self:take()
+    if #statements == 0 and not self.started then
+        return self:finish()
+    end
+
+    local function rollback(err)
+        self:send(self.rollbackSql, function()
+            self:finish(err)
+        end)
+    end
+
+    local function commit(err)
+        if err then
+            return rollback(err)
+        end
+
+        self:send(self.commitSql, function(err)
+            if err then
+                return rollback(err)
+            end
+            self:finish()
+        end)
+    end
+
+    if not self.connection.multiStatements then
+        return self:send(statements, commit)
+    end
+
+    -- A group sent as one query stops at its first failing statement, before the COMMIT
+    for _, sql in ipairs(self.commitSql) do
+        statements[#statements+1] = sql
+    end
+
+    self:send(statements, function(err)
+        if err then
+            return rollback(err)
+        end
+        self:finish()
+    end)
+end
+
+function Transaction:finish(err)
+    if err then
+        self:emit("rollback", err)
+    else
+        self:emit("commit")
+    end
+
+    if self.callback then
+        self.callback(err)
+    end
+end
+
+local function runTransaction(connection, fn, callback)
+    local transaction = Transaction:new(connection)
+    transaction:run(fn, callback)
+    return transaction
+end
+
+return {
+    Transaction = Transaction,
+    runTransaction = runTransaction
+}
@@ -3,8 +3,14 @@
 #include <lauxlib.h>
 #include <malloc.h>
 #include <assert.h>
+#include <string.h>
+#include <stdint.h>
 
 #define META_TABLE "opendbxuv_handle"
+#define STATEMENT_META_TABLE "opendbxuv_statement"
+#define COLUMNAR_META_TABLE "opendbxuv_columnar"
+#define BUFFER_META_TABLE "opendbxuv_buffer"
+#define STATE_META_TABLE "opendbxuv_state"
 #if 0
 #define HANDLE_REF(L, handle, index)    do { printf("Handle ref: %p %i %s\n", handle, index, __PRETTY_FUNCTION__); _handle_ref(L, handle, index); } while(0);
 #define HANDLE_UNREF(L, handle)         do { printf("Handle unref: %p %s\n", handle, __PRETTY_FUNCTION__); _handle_unref(L, handle); } while(0);
@@ -33,7 +39,7 @@ void stackDump(lua_State *L)
     }
 }
 
-typedef struct {
+typedef struct lua_odbxuv_handle_s {
     odbxuv_handle_t* handle; /* The actual opendbxuv handle. memory managed by us */
     int refCount;        /* a count of all pending request to know strength */
     lua_State* L;        /* L and ref together form a reference to the userdata */
@@ -49,17 +55,358 @@ typedef struct {
                              1 when user/gc is closing the handle,
                              2 when user cloesd it but the handle is still referenced and we're waiting for the GC to kick in */
     const char* type;
+    struct odbxuv_lua_state_s* state; /* per lua_State data of the state the handle belongs to */
+    char pool;           /* ODBXUV_LUA_POOL_* the native handle came from */
+    char started;        /* 1 once the handle was passed to opendbxuv and has to be closed through it */
+    struct {
+        struct lua_odbxuv_handle_s* prev; /* live handles, oldest first */
+        struct lua_odbxuv_handle_s* next;
+        uint64_t created;                 /* uv_hrtime of creation */
+    } live;
+    struct {
+        int batch;       /* rows per "rows" event, 0 emits a "row" event per row */
+        int pending;     /* rows collected in the current batch */
+        int rowsref;     /* reference to the batch table being filled, LUA_NOREF when empty */
+        char typed;      /* 1 when numeric and boolean columns are converted to lua values */
+        char* kinds;     /* per column ODBXUV_LUA_KIND_*, captured when the result arrives */
+        char named;      /* 1 when rows are tables keyed by column name */
+        int namesref;    /* reference to the array of column names, interned once per result */
+        char paused;     /* 1 while rows are held back in queue instead of being delivered */
+        int highWaterMark; /* pause automatically after this many rows were delivered, 0 never pauses */
+        int delivered;   /* rows delivered since the last resume */
+        struct odbxuv_lua_queued_row_s* queue;     /* rows that arrived while paused, oldest first */
+        struct odbxuv_lua_queued_row_s* queueTail;
+        int queued;
+        size_t queuedBytes;
+        int maxQueued;   /* most rows and bytes held at once, reported by native.queryStats */
+        size_t maxQueuedBytes;
+        size_t queueLimit; /* bytes the queue may hold before the query fails, 0 for no limit */
+        char overflowed; /* 1 once the queue limit was hit, the rest of the result is dropped */
+        char wantColumnar; /* 1 when the whole result is collected into column arrays */
+        struct odbxuv_lua_columnar_s* columnar; /* result collected into column arrays, NULL unless fetched columnar */
+    } fetch;
+    struct {
+        char dialect;    /* ODBXUV_LUA_DIALECT_* of the backend, used for escaping in process */
+        char connecting; /* 1 between connect and its callback, queries are queued meanwhile */
+        int maxInFlight; /* queries handed to opendbxuv at once, 0 for no limit */
+        int inFlight;
+        int queued;
+        struct lua_odbxuv_handle_s* queue;      /* queries waiting to be dispatched, oldest first */
+        struct lua_odbxuv_handle_s* queueTail;
+        struct odbxuv_lua_histograms_s* histograms; /* latencies of the queries of the connection, allocated on first use */
+    } conn;
+    struct {
+        struct lua_odbxuv_handle_s* connection; /* connection the query was submitted to */
+        struct lua_odbxuv_handle_s* next;       /* next query in the connection queue */
+        const char* sql;     /* pinned in the environment of the handle */
+        int flags;
+        char queued;         /* 1 while waiting in the connection queue */
+        uint64_t submitted;  /* uv_hrtime of submission, dispatch and completion */
+        uint64_t dispatched;
+        uint64_t done;
+        uint64_t firstRow;   /* uv_hrtime of the first and last fetch callback from the backend */
+        uint64_t lastRow;
+        uint64_t closed;
+        uint64_t callbackTime; /* nanoseconds spent delivering rows to lua */
+        uint64_t rows;
+        uint64_t bytes;      /* bytes of the column values handed to lua */
+        uv_timer_t* timer;   /* deadline set with options.timeout, NULL without one */
+        int timeout;         /* ms */
+        char abandoned;      /* 1 after a timeout or cancel, the result is closed when it arrives */
+        struct odbxuv_lua_query_buffer_s* buffer; /* buffer sql points into, recycled once the backend is done with it */
+    } query;
+    struct {
+        char enabled;        /* 1 when events resume a coroutine waiting in native.await instead of calling handlers */
+        int waitref;         /* reference to the coroutine waiting for the next event, LUA_NOREF when none */
+        int eventsref;       /* reference to the events that arrived while nobody was waiting */
+        int head;            /* first and last index of queued events */
+        int tail;
+    } co;
 } lua_odbxuv_handle_t;
 
-static lua_State* _get_main_thread(lua_State *L)
+/* Backends whose string escaping is a pure transform we can do ourselves */
+enum {
+    ODBXUV_LUA_DIALECT_NONE = 0,
+    ODBXUV_LUA_DIALECT_SQLITE   /* ' is doubled */
+};
+
+/* Growable byte buffer, always kept NUL terminated */
+typedef struct {
+    char* data;
+    size_t length;
+    size_t size;
+} odbxuv_lua_buffer_t;
+
+/* Sql text built from lua with native.buffer*, native.query uses it in place */
+typedef struct odbxuv_lua_query_buffer_s {
+    odbxuv_lua_buffer_t buffer;
+    struct odbxuv_lua_state_s* state; /* whose spare memory the buffer uses */
+    char busy;           /* 1 while a query uses the text, changing it is refused meanwhile */
+} odbxuv_lua_query_buffer_t;
+
+/* A placeholder in a prepared statement and the literal sql in front of it */
+typedef struct {
+    size_t textStart;
+    size_t textLength;
+    int position;        /* 1 based index for ? placeholders, 0 for :name placeholders */
+    const char* name;    /* name of :name placeholders, points into names */
+} odbxuv_lua_placeholder_t;
+
+/* Sql split up at its placeholders, values are spliced in on execute */
+typedef struct {
+    char* sql;
+    char* names;
+    size_t tailStart;    /* literal sql following the last placeholder */
+    int count;
+    odbxuv_lua_placeholder_t* placeholders;
+} odbxuv_lua_statement_t;
+
+/* A column of a columnar result. Layout is mirrored by the ffi.cdef in odbxuv/columnar.lua */
+typedef struct {
+    int kind;            /* ODBXUV_LUA_KIND_*, columns with values that do not parse fall back to STRING */
+    int64_t* integers;   /* INTEGER and BOOLEAN values */
+    double* numbers;     /* NUMBER values */
+    size_t* offsets;     /* STRING value i is bytes[offsets[i]] up to bytes[offsets[i + 1]] */
+    char* bytes;
+    uint8_t* nulls;      /* bit i & 7 of nulls[i >> 3] is set when value i is NULL */
+    size_t capacity;     /* rows the arrays have room for */
+    size_t byteLength;
+    size_t byteCapacity;
+} odbxuv_lua_column_t;
+
+typedef struct odbxuv_lua_columnar_s {
+    size_t rowCount;
+    int columnCount;
+    odbxuv_lua_column_t* columns;
+} odbxuv_lua_columnar_t;
+
+/* A fetch callback that arrived while the query was paused, values are copied */
+typedef struct odbxuv_lua_queued_row_s {
+    struct odbxuv_lua_queued_row_s* next;
+    size_t size;         /* bytes allocated for the copy */
+    int status;
+    char first;          /* 1 when this was the first callback of the result */
+    char end;            /* 1 for the end of the result */
+    odbxuv_row_t row;
+} odbxuv_lua_queued_row_t;
+
+#define ODBXUV_LUA_HISTOGRAM_BUCKETS 160
+
+/* Bytes of rows a paused query holds by default before it fails */
+#define ODBXUV_LUA_DEFAULT_QUEUE_LIMIT (16 * 1024 * 1024)
+
+/* Latency histogram in microseconds, 4 buckets per power of two */
+typedef struct {
+    uint32_t buckets[ODBXUV_LUA_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} odbxuv_lua_histogram_t;
+
+typedef struct odbxuv_lua_histograms_s {
+    odbxuv_lua_histogram_t queueWait;  /* submission to dispatch */
+    odbxuv_lua_histogram_t execution;  /* dispatch to the query callback */
+    odbxuv_lua_histogram_t fetch;      /* query callback to the last row */
+    odbxuv_lua_histogram_t callback;   /* time spent in lua handling rows */
+} odbxuv_lua_histograms_t;
+
+/* How a column value is pushed in typed mode */
+enum {
+    ODBXUV_LUA_KIND_STRING = 0,
+    ODBXUV_LUA_KIND_INTEGER,
+    ODBXUV_LUA_KIND_NUMBER,
+    ODBXUV_LUA_KIND_BOOLEAN
+};
+
+/* Integers beyond this do not fit a lua number exactly, typed mode keeps them as strings */
+#define ODBXUV_LUA_MAX_EXACT_INTEGER 9007199254740992LL
+
+/* Events a handle emits. Handlers are kept in the handle environment under these indices */
+enum {
+    ODBXUV_LUA_EVENT_CONNECT = 1,
+    ODBXUV_LUA_EVENT_DISCONNECT,
+    ODBXUV_LUA_EVENT_ESCAPE,
+    ODBXUV_LUA_EVENT_QUERY,
+    ODBXUV_LUA_EVENT_FETCH,
+    ODBXUV_LUA_EVENT_ROW,
+    ODBXUV_LUA_EVENT_ROWS,
+    ODBXUV_LUA_EVENT_PAUSE,
+    ODBXUV_LUA_EVENT_COLUMNAR,
+    ODBXUV_LUA_EVENT_FETCHED,
+    ODBXUV_LUA_EVENT_ERROR,
+    ODBXUV_LUA_EVENT_CLOSE,
+    ODBXUV_LUA_EVENT_COUNT
+};
+
+static const char *_event_names[ODBXUV_LUA_EVENT_COUNT] = {
+    NULL, "connect", "disconnect", "escape", "query", "fetch", "row", "rows",
+    "pause", "columnar", "fetched", "error", "close"
+};
+
+/* Index of a named event, 0 for names that are never emitted */
+static int _event_index(const char* name)
+{
+    int i;
+    for(i = 1; i < ODBXUV_LUA_EVENT_COUNT; i++)
+    {
+        if(strcmp(_event_names[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/* Native handles and ops are recycled through free lists of their lua_State instead of
+ * going through malloc/free for every query. A state is only used from its loop thread,
+ * so the lists need no locking. */
+enum {
+    ODBXUV_LUA_POOL_CONNECTION = 0,
+    ODBXUV_LUA_POOL_QUERY,
+    ODBXUV_LUA_POOL_ESCAPE,
+    ODBXUV_LUA_POOL_CONNECT,
+    ODBXUV_LUA_POOL_DISCONNECT,
+    ODBXUV_LUA_POOL_COUNT
+};
+
+/* Precedes every pooled allocation to remember where it goes back to */
+typedef union {
+    struct {
+        struct odbxuv_lua_state_s* state;
+        int index;
+    } owner;
+    double alignDouble;
+    long long alignLong;
+    void* alignPointer;
+} odbxuv_lua_pool_header_t;
+
+typedef struct {
+    const char* name;
+    size_t size;
+    void* free;             /* free objects, linked through their first word */
+    int freeCount;
+    int maxFree;            /* objects beyond this are given back to malloc */
+    int inUse;
+    int highWater;          /* highest inUse seen */
+    unsigned long hits;     /* allocations served from the free list */
+    unsigned long misses;   /* allocations that needed malloc */
+} odbxuv_lua_pool_t;
+
+/* Copied into every new state */
+static const odbxuv_lua_pool_t _pool_templates[ODBXUV_LUA_POOL_COUNT] = {
+    { "connection", sizeof(odbxuv_connection_t),    NULL, 0, 16 },
+    { "query",      sizeof(odbxuv_op_query_t),      NULL, 0, 256 },
+    { "escape",     sizeof(odbxuv_op_escape_t),     NULL, 0, 256 },
+    { "connect",    sizeof(odbxuv_op_connect_t),    NULL, 0, 16 },
+    { "disconnect", sizeof(odbxuv_op_disconnect_t), NULL, 0, 16 }
+};
+
+#define ODBXUV_LUA_MAX_SPARE_BUFFERS 8
+#define ODBXUV_LUA_MAX_SPARE_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* Every handle from creation until it is collected, kept in creation order so the
+ * long lived ones are found without walking all of them */
+typedef struct {
+    lua_odbxuv_handle_t* head;
+    lua_odbxuv_handle_t* tail;
+    int count;
+    int counts[ODBXUV_LUA_POOL_COUNT][3];   /* by pool and status */
+    unsigned long leaked;                   /* collected without being closed */
+} odbxuv_lua_live_t;
+
+/* Per lua_State data, kept in the registry as "odbxuv_state". Handles point to the one of
+ * their state so callbacks resolve how they are invoked only once. It is malloc'd, native
+ * objects still on their way back from opendbxuv keep it alive after lua_close */
+typedef struct odbxuv_lua_state_s {
+    lua_State* main;     /* main thread, NULL until known */
+    int eventSourceRef;  /* eventSource(name, fn, ...) wrapping every callback, LUA_NOREF calls handlers directly */
+    char resolved;       /* 1 once the eventSource global was looked up or native.setEventSource was called */
+    struct {
+        int freeCount;   /* spare environments in the "odbxuv_envs" registry table */
+        int inUse;
+        int highWater;
+        unsigned long hits;
+        unsigned long misses;
+    } envs;
+    odbxuv_lua_pool_t pools[ODBXUV_LUA_POOL_COUNT];
+    struct {
+        odbxuv_lua_buffer_t buffers[ODBXUV_LUA_MAX_SPARE_BUFFERS]; /* memory of query buffers whose query completed */
+        int count;
+        int inUse;       /* live buffer userdata */
+        int highWater;
+        unsigned long hits;
+        unsigned long misses;
+    } spareBuffers;
+    odbxuv_lua_buffer_t sql; /* scratch space for building sql, only used synchronously */
+    odbxuv_lua_live_t live;
+    char closed;         /* 1 once the lua_State was closed */
+} odbxuv_lua_state_t;
+
+static odbxuv_lua_state_t* _get_state(lua_State *L)
 {
-    lua_State *main_thread;
+    odbxuv_lua_state_t** box;
 
-    lua_getfield(L, LUA_REGISTRYINDEX, "main_thread");
-        main_thread = lua_tothread(L, -1);
+    lua_getfield(L, LUA_REGISTRYINDEX, "odbxuv_state");
+    box = (odbxuv_lua_state_t **)lua_touserdata(L, -1);
     lua_pop(L, 1);
 
-    return main_thread;
+    return box ? *box : NULL;
+}
+
+/* Frees the state once its lua_State was closed and none of its native objects is left */
+static void _state_release(odbxuv_lua_state_t* state)
+{
+    int i;
+
+    if(!state->closed || state->live.count > 0 || state->spareBuffers.inUse > 0)
+    {
+        return;
+    }
+    for(i = 0; i < ODBXUV_LUA_POOL_COUNT; i++)
+    {
+        if(state->pools[i].inUse > 0)
+        {
+            return;
+        }
+    }
+
+    for(i = 0; i < ODBXUV_LUA_POOL_COUNT; i++)
+    {
+        void* object = state->pools[i].free;
+        while(object)
+        {
+            void* next = *(void **)object;
+            free((odbxuv_lua_pool_header_t *)object - 1);
+            object = next;
+        }
+    }
+    for(i = 0; i < state->spareBuffers.count; i++)
+    {
+        free(state->spareBuffers.buffers[i].data);
+    }
+    free(state->sql.data);
+    free(state);
+}
+
+static int _state_gc(lua_State *L)
+{
+    odbxuv_lua_state_t* state = *(odbxuv_lua_state_t **)lua_touserdata(L, 1);
+
+    state->closed = 1;
+    _state_release(state);
+    return 0;
+}
+
+static lua_State* _get_main_thread(lua_State *L, odbxuv_lua_state_t* state)
+{
+    if(!state->main)
+    {
+        lua_getfield(L, LUA_REGISTRYINDEX, "main_thread");
+            state->main = lua_tothread(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return state->main;
 }
 
 static uv_loop_t *_get_loop(lua_State *L)
@@ -86,10 +433,212 @@ static odbxuv_handle_t* _check_userdata(lua_State* L, int index, const char* typ
     return ((lua_odbxuv_handle_t *)lua_touserdata(L, index))->handle;
 }
 
+/* Environment tables of collected handles, cleared and handed to new handles of the same state */
+#define ODBXUV_LUA_MAX_FREE_ENVS 256
+
+static void* _pool_alloc(odbxuv_lua_state_t* state, int index)
+{
+    odbxuv_lua_pool_t *pool = &state->pools[index];
+    odbxuv_lua_pool_header_t *header;
+
+    if(pool->free)
+    {
+        header = (odbxuv_lua_pool_header_t *)pool->free - 1;
+        pool->free = *(void **)pool->free;
+        pool->freeCount--;
+        pool->hits++;
+    }
+    else
+    {
+        header = (odbxuv_lua_pool_header_t *)malloc(sizeof(odbxuv_lua_pool_header_t) + pool->size);
+        header->owner.state = state;
+        header->owner.index = index;
+        pool->misses++;
+    }
+
+    if(++pool->inUse > pool->highWater)
+    {
+        pool->highWater = pool->inUse;
+    }
+
+    /* Handles that never reach opendbxuv are freed as they are, keep stale pointers out */
+    memset(header + 1, 0, pool->size);
+    return header + 1;
+}
+
+static void _pool_free(void* object)
+{
+    odbxuv_lua_pool_header_t *header = (odbxuv_lua_pool_header_t *)object - 1;
+    odbxuv_lua_state_t *state = header->owner.state;
+    odbxuv_lua_pool_t *pool = &state->pools[header->owner.index];
+
+    pool->inUse--;
+
+    if(pool->freeCount < pool->maxFree)
+    {
+        *(void **)object = pool->free;
+        pool->free = object;
+        pool->freeCount++;
+    }
+    else
+    {
+        free(header);
+    }
+
+    _state_release(state);
+}
+
+/* Pushes an empty table to be used as handle environment */
+static void _env_create(lua_State* L, odbxuv_lua_state_t* state)
+{
+    if(++state->envs.inUse > state->envs.highWater)
+    {
+        state->envs.highWater = state->envs.inUse;
+    }
+
+    if(state->envs.freeCount > 0)
+    {
+        lua_getfield(L, LUA_REGISTRYINDEX, "odbxuv_envs");
+        lua_rawgeti(L, -1, state->envs.freeCount);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, state->envs.freeCount--);
+        lua_remove(L, -2);
+        state->envs.hits++;
+    }
+    else
+    {
+        /* Room for every event handler plus the pinned query and connection */
+        lua_createtable(L, ODBXUV_LUA_EVENT_COUNT - 1, 2);
+        state->envs.misses++;
+    }
+}
+
+/* Clears the environment of the collected userdata at index and keeps it for reuse */
+static void _env_release(lua_State* L, odbxuv_lua_state_t* state, int index)
+{
+    state->envs.inUse--;
+
+    if(state->envs.freeCount >= ODBXUV_LUA_MAX_FREE_ENVS)
+    {
+        return;
+    }
+
+    lua_getfenv(L, index);
+    lua_pushnil(L);
+    while(lua_next(L, -2))
+    {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "odbxuv_envs");
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, ++state->envs.freeCount);
+    lua_pop(L, 1);
+}
+
+static void _push_pool_stats(lua_State* L, int inUse, int highWater, int freeCount, unsigned long hits, unsigned long misses)
+{
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, inUse);
+    lua_setfield(L, -2, "inUse");
+    lua_pushinteger(L, highWater);
+    lua_setfield(L, -2, "highWater");
+    lua_pushinteger(L, freeCount);
+    lua_setfield(L, -2, "free");
+    lua_pushnumber(L, hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, misses);
+    lua_setfield(L, -2, "misses");
+}
+
+/* native.poolStats() -> {query = {inUse, highWater, free, hits, misses}, ...} */
+int odbxuv_lua_pool_stats(lua_State* L)
+{
+    int i;
+    odbxuv_lua_state_t* state = _get_state(L);
+
+    lua_createtable(L, 0, ODBXUV_LUA_POOL_COUNT + 2);
+    for(i = 0; i < ODBXUV_LUA_POOL_COUNT; i++)
+    {
+        odbxuv_lua_pool_t *pool = &state->pools[i];
+        _push_pool_stats(L, pool->inUse, pool->highWater, pool->freeCount, pool->hits, pool->misses);
+        lua_setfield(L, -2, pool->name);
+    }
+
+    _push_pool_stats(L, state->envs.inUse, state->envs.highWater, state->envs.freeCount, state->envs.hits, state->envs.misses);
+    lua_setfield(L, -2, "env");
+
+    _push_pool_stats(L, state->spareBuffers.inUse, state->spareBuffers.highWater, state->spareBuffers.count,
+        state->spareBuffers.hits, state->spareBuffers.misses);
+    lua_setfield(L, -2, "buffer");
+
+    return 1;
+}
+
+
+static void _live_add(lua_odbxuv_handle_t* lhandle)
+{
+    odbxuv_lua_live_t* live = &lhandle->state->live;
+
+    lhandle->live.created = uv_hrtime();
+    lhandle->live.next = NULL;
+    lhandle->live.prev = live->tail;
+    if(live->tail)
+    {
+        live->tail->live.next = lhandle;
+    }
+    else
+    {
+        live->head = lhandle;
+    }
+    live->tail = lhandle;
+
+    live->count++;
+    live->counts[(int)lhandle->pool][(int)lhandle->status]++;
+}
+
+static void _live_remove(lua_odbxuv_handle_t* lhandle)
+{
+    odbxuv_lua_live_t* live = &lhandle->state->live;
+
+    if(lhandle->live.prev)
+    {
+        lhandle->live.prev->live.next = lhandle->live.next;
+    }
+    else
+    {
+        live->head = lhandle->live.next;
+    }
+    if(lhandle->live.next)
+    {
+        lhandle->live.next->live.prev = lhandle->live.prev;
+    }
+    else
+    {
+        live->tail = lhandle->live.prev;
+    }
+
+    live->count--;
+    live->counts[(int)lhandle->pool][(int)lhandle->status]--;
+}
+
+static void _set_status(lua_odbxuv_handle_t* lhandle, char status)
+{
+    odbxuv_lua_live_t* live = &lhandle->state->live;
+
+    live->counts[(int)lhandle->pool][(int)lhandle->status]--;
+    live->counts[(int)lhandle->pool][(int)status]++;
+    lhandle->status = status;
+}
+
 /* Initialize a new lhandle and push the new userdata on the stack. */
-static lua_odbxuv_handle_t *_handle_create(lua_State* L, size_t size, const char* type)
+static lua_odbxuv_handle_t *_handle_create(lua_State* L, int pool, const char* type)
 {
     lua_State* mainthread;
+    odbxuv_lua_state_t* state = _get_state(L);
     /* Create the userdata and set it's metatable */
     lua_odbxuv_handle_t* lhandle = (lua_odbxuv_handle_t*)lua_newuserdata(L, sizeof(lua_odbxuv_handle_t));
 
@@ -98,26 +647,70 @@ static lua_odbxuv_handle_t *_handle_create(lua_State* L, size_t size, const char
     lua_setmetatable(L, -2);
 
     /* Create a local environment for storing stuff */
-    lua_newtable(L);
+    _env_create(L, state);
     lua_setfenv (L, -2);
 
     /* Initialize and return the lhandle */
-    lhandle->handle = (odbxuv_handle_t*)malloc(size);
+    lhandle->handle = (odbxuv_handle_t*)_pool_alloc(state, pool);
     lhandle->handle->data = lhandle; /* Point back to lhandle from handle */
     lhandle->refCount = 0;
-    lhandle->L = L;
 
-    /* if handle create in a coroutine, we need hold the coroutine */
-    mainthread = _get_main_thread(L);
-    if (L != mainthread) {
-        lua_pushthread(L);
+    /* Callbacks run on the main thread, a coroutine that created the handle may be
+     * suspended (or waiting in native.await) by then and its stack must not be touched.
+     * Without a known main thread we fall back to holding the creating coroutine */
+    mainthread = _get_main_thread(L, state);
+    if (mainthread) {
+        lhandle->L = mainthread;
+        lhandle->threadref = LUA_NOREF;
+    } else if (!lua_pushthread(L)) {
+        lhandle->L = L;
         lhandle->threadref = luaL_ref(L, LUA_REGISTRYINDEX);
     } else {
+        lua_pop(L, 1);
+        lhandle->L = L;
         lhandle->threadref = LUA_NOREF;
     }
     lhandle->ref = LUA_NOREF;
     lhandle->status = 0;
     lhandle->type = type;
+    lhandle->state = state;
+    lhandle->pool = pool;
+    lhandle->started = 0;
+    lhandle->fetch.batch = 0;
+    lhandle->fetch.pending = 0;
+    lhandle->fetch.rowsref = LUA_NOREF;
+    lhandle->fetch.typed = 0;
+    lhandle->fetch.kinds = NULL;
+    lhandle->fetch.named = 0;
+    lhandle->fetch.namesref = LUA_NOREF;
+    lhandle->fetch.paused = 0;
+    lhandle->fetch.highWaterMark = 0;
+    lhandle->fetch.delivered = 0;
+    lhandle->fetch.queue = NULL;
+    lhandle->fetch.queueTail = NULL;
+    lhandle->fetch.queued = 0;
+    lhandle->fetch.queuedBytes = 0;
+    lhandle->fetch.maxQueued = 0;
+    lhandle->fetch.maxQueuedBytes = 0;
+    lhandle->fetch.queueLimit = ODBXUV_LUA_DEFAULT_QUEUE_LIMIT;
+    lhandle->fetch.overflowed = 0;
+    lhandle->fetch.wantColumnar = 0;
+    lhandle->fetch.columnar = NULL;
+    lhandle->conn.dialect = ODBXUV_LUA_DIALECT_NONE;
+    lhandle->conn.connecting = 0;
+    lhandle->conn.maxInFlight = 0;
+    lhandle->conn.inFlight = 0;
+    lhandle->conn.queued = 0;
+    lhandle->conn.queue = NULL;
+    lhandle->conn.queueTail = NULL;
+    lhandle->conn.histograms = NULL;
+    memset(&lhandle->query, 0, sizeof(lhandle->query));
+    lhandle->co.enabled = 0;
+    lhandle->co.waitref = LUA_NOREF;
+    lhandle->co.eventsref = LUA_NOREF;
+    lhandle->co.head = 1;
+    lhandle->co.tail = 0;
+    _live_add(lhandle);
     return lhandle;
 }
 
@@ -148,6 +741,42 @@ static void _handle_unref(lua_State* L, lua_odbxuv_handle_t* lhandle)
     }
 }
 
+/* Forgets about the rows collected for a "rows" event */
+static void _drop_batch(lua_State* L, lua_odbxuv_handle_t* lhandle)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, lhandle->fetch.rowsref);
+    lhandle->fetch.rowsref = LUA_NOREF;
+    lhandle->fetch.pending = 0;
+}
+
+/* Releases all state kept while fetching rows */
+static void _columnar_free(odbxuv_lua_columnar_t* columnar);
+
+static void _fetch_done(lua_State* L, lua_odbxuv_handle_t* lhandle)
+{
+    _drop_batch(L, lhandle);
+    if(lhandle->fetch.columnar)
+    {
+        _columnar_free(lhandle->fetch.columnar);
+        free(lhandle->fetch.columnar);
+        lhandle->fetch.columnar = NULL;
+    }
+    free(lhandle->fetch.kinds);
+    lhandle->fetch.kinds = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, lhandle->fetch.namesref);
+    lhandle->fetch.namesref = LUA_NOREF;
+
+    while(lhandle->fetch.queue)
+    {
+        odbxuv_lua_queued_row_t *queued = lhandle->fetch.queue;
+        lhandle->fetch.queue = queued->next;
+        free(queued);
+    }
+    lhandle->fetch.queueTail = NULL;
+    lhandle->fetch.queued = 0;
+    lhandle->fetch.queuedBytes = 0;
+}
+
 #define _KILL_REFS(obj)                 \
 if (obj->ref != LUA_NOREF)              \
 {                                       \
@@ -165,40 +794,132 @@ static lua_State* _op_get_lua(lua_odbxuv_handle_t* lhandle)
     return lhandle->L;
 }
 
-/* Meant as a lua_call replace for use in async callbacks
- * Uses the main loop and event source
+/* Uses the global eventSource function unless native.setEventSource was called before the first event */
+static void _resolve_event_source(lua_State *L, odbxuv_lua_state_t* state)
+{
+    state->resolved = 1;
+
+    lua_getglobal(L, "eventSource");
+    if(lua_isfunction(L, -1))
+    {
+        state->eventSourceRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+}
+
+/* Meant as a lua_call replace for use in async callbacks, calls the function below the
+ * nargs arguments on the main thread. Wrapped with the event source when there is one,
+ * otherwise a plain lua_pcall and errors are reported on stderr
  */
-static void _acall(lua_State *C, int nargs, int nresults, const char* source) {
-    lua_State* L;
-    
-    /* Get the main thread without cheating */
-    lua_getfield(C, LUA_REGISTRYINDEX, "main_thread");
-    L = lua_tothread(C, -1);
-    lua_pop(C, 1);
-    
+static void _acall(odbxuv_lua_state_t* state, lua_State *C, int nargs, const char* source) {
+    lua_State* L = state->main ? state->main : C;
+
     /* If C is not main then move to main */
     if (C != L) {
-        lua_getglobal(L, "eventSource");
-        lua_pushstring(L, source);
-        lua_xmove (C, L, nargs + 1);
-        lua_call(L, nargs + 2, nresults);
-    } else {
-        
-        /* Wrap the call with the eventSource function */
-        int offset = nargs + 2;
-        lua_getglobal(L, "eventSource");
-        lua_insert(L, -offset);
+        lua_xmove(C, L, nargs + 1);
+    }
+
+    if (!state->resolved) {
+        _resolve_event_source(L, state);
+    }
+
+    if (state->eventSourceRef != LUA_NOREF) {
+        /* eventSource(source, fn, args...) */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, state->eventSourceRef);
+        lua_insert(L, -nargs - 2);
         lua_pushstring(L, source);
-        lua_insert(L, -offset);
-        lua_call(L, nargs + 2, nresults);
+        lua_insert(L, -nargs - 2);
+        lua_call(L, nargs + 2, 0);
+        return;
+    }
+
+    if (lua_pcall(L, nargs, 0, 0) != 0) {
+        fprintf(stderr, "odbxuv-lua Error: %s handler failed: %s\n", source, lua_tostring(L, -1));
+        lua_pop(L, 1);
     }
 }
 
-static void _emit_event(lua_State* L, const char* name, int nargs)
+/* Hands the event on top of the stack to the coroutine waiting for it,
+ * or keeps it until native.await is called */
+static void _resume_event(lua_State* L, lua_odbxuv_handle_t* lhandle, const char* name, int nargs)
 {
-    /* Load the connection callback */
+    int i, count = nargs + 1;
+
+    lua_pushstring(L, name);
+    lua_insert(L, -count);
+
+    if(lhandle->co.waitref != LUA_NOREF)
+    {
+        lua_State* co;
+        int status;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->co.waitref);
+        co = lua_tothread(L, -1);
+        lua_pop(L, 1);
+
+        /* Keep the coroutine referenced by the stack while it runs */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->co.waitref);
+        lua_insert(L, -count - 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, lhandle->co.waitref);
+        lhandle->co.waitref = LUA_NOREF;
+
+        lua_xmove(L, co, count);
+        status = lua_resume(co, count);
+
+        if(status != 0 && status != LUA_YIELD)
+        {
+            fprintf(stderr, "odbxuv-lua Error: coroutine failed handling %s: %s\n", name, lua_tostring(co, -1));
+        }
+        if(status != LUA_YIELD)
+        {
+            lua_settop(co, 0);
+        }
+
+        /* Remove the coroutine */
+        lua_pop(L, 1);
+        return;
+    }
+
+    /* Nobody is waiting, store {name, args..., n = count} */
+    lua_createtable(L, count, 1);
+    lua_insert(L, -count - 1);
+    for(i = count; i > 0; i--)
+    {
+        lua_rawseti(L, -(i + 1), i);
+    }
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "n");
+
+    if(lhandle->co.eventsref == LUA_NOREF)
+    {
+        lua_newtable(L);
+        lhandle->co.eventsref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->co.eventsref);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, ++lhandle->co.tail);
+    lua_pop(L, 1);
+}
+
+static void _emit_event(lua_State* L, int event, int nargs)
+{
+    lua_odbxuv_handle_t* lhandle = (lua_odbxuv_handle_t *)lua_touserdata(L, -nargs - 1);
+
+    if(lhandle->co.enabled)
+    {
+        /* Remove the userdata */
+        lua_remove(L, -nargs - 1);
+        _resume_event(L, lhandle, _event_names[event], nargs);
+        return;
+    }
+
+    /* Load the callback from its slot in the userdata environment */
     lua_getfenv(L, -nargs - 1);
-    lua_getfield(L, -1, name);
+    lua_rawgeti(L, -1, event);
     /* remove the userdata environment */
     lua_remove(L, -2);
     /* Remove the userdata */
@@ -207,21 +928,32 @@ static void _emit_event(lua_State* L, const char* name, int nargs)
     if (lua_isfunction (L, -1) == 0) {
         const char *typeName = lua_typename(L, -1);
         lua_pop(L, 1 + nargs);
-        fprintf(stderr, "odbxuv-lua Warning: No callback function named: %s (argc:%i, found: %s)\n", name, nargs, typeName);
+        fprintf(stderr, "odbxuv-lua Warning: No callback function named: %s (argc:%i, found: %s)\n", _event_names[event], nargs, typeName);
         return;
     }
 
     /* move the function below the args */
     lua_insert(L, -nargs - 1);
-    _acall(L, nargs, 0, name);
+    _acall(lhandle->state, L, nargs, _event_names[event]);
 }
 
-/* Registers a callback, callback_index can't be negative */
+/* Registers a callback, callback_index can't be negative.
+ * Callbacks stay in the environment rather than the registry so a handler
+ * capturing its own handle does not keep the handle alive */
 static void _register_event(lua_State* L, int userdata_index, const char* name, int callback_index)
 {
+    int event = _event_index(name);
+
     lua_getfenv(L, userdata_index);
     lua_pushvalue(L, callback_index);
-    lua_setfield(L, -2, name);
+    if(event)
+    {
+        lua_rawseti(L, -2, event);
+    }
+    else
+    {
+        lua_setfield(L, -2, name);
+    }
     lua_pop(L, 1);
 }
 
@@ -295,6 +1027,21 @@ static void _push_async_error(lua_State* L, odbxuv_handle_t *op, const char* sou
     _push_async_error_raw(L, op->error->error, op->error->errorType, op->error->errorString, source, path);
 }
 
+static void _free_timer(uv_handle_t *timer)
+{
+    free(timer);
+}
+
+static void _stop_query_timer(lua_odbxuv_handle_t *lhandle)
+{
+    if(lhandle->query.timer)
+    {
+        uv_timer_stop(lhandle->query.timer);
+        uv_close((uv_handle_t *)lhandle->query.timer, _free_timer);
+        lhandle->query.timer = NULL;
+    }
+}
+
 static void _handle_close(odbxuv_handle_t* handle)
 {
     lua_odbxuv_handle_t * lhandle = (lua_odbxuv_handle_t *)handle->data;
@@ -302,7 +1049,25 @@ static void _handle_close(odbxuv_handle_t* handle)
     if(lhandle && lhandle->refCount > 0)
     {
         lua_State* L = _op_get_lua(lhandle);
-        _emit_event(L, "close", 0);
+        int listening = 1;
+
+        /* Abandoned queries lost their handlers unless close was called afterwards */
+        if(lhandle->query.abandoned && !lhandle->co.enabled)
+        {
+            lua_getfenv(L, -1);
+            lua_rawgeti(L, -1, ODBXUV_LUA_EVENT_CLOSE);
+            listening = lua_isfunction(L, -1);
+            lua_pop(L, 2);
+        }
+
+        if(listening)
+        {
+            _emit_event(L, ODBXUV_LUA_EVENT_CLOSE, 0);
+        }
+        else
+        {
+            lua_pop(L, 1);
+        }
         HANDLE_UNREF(L, lhandle);
     }
 
@@ -310,18 +1075,26 @@ static void _handle_close(odbxuv_handle_t* handle)
     {
         //printf("FREE handle: %p %s\n", handle, lhandle ? lhandle->type : "");
         odbxuv_free_handle(handle);
-        free(handle);
+        _pool_free(handle);
     }
     else
     {
-        lhandle->status = 2;
+        _set_status(lhandle, 2);
         //printf("Delay closing of %s %i\n", lhandle->type, lhandle->refCount);
     }
 }
 
-static int _close_handle(odbxuv_handle_t *handle)
+static int _close_handle(odbxuv_handle_t *handle, int started)
 {
-    odbxuv_close(handle, _handle_close);
+    if(started)
+    {
+        odbxuv_close(handle, _handle_close);
+    }
+    else
+    {
+        /* opendbxuv never saw this handle */
+        _handle_close(handle);
+    }
     return 0;
 }
 
@@ -334,12 +1107,14 @@ static int _handle_gc(lua_State* L)
         if(lhandle->status == 0)
         {
             fprintf(stderr, "WARNING: forgot to close %s lhandle=%p handle=%p status=%i\n", lhandle->type, lhandle, lhandle->handle, lhandle->status);
+            lhandle->state->live.leaked++;
             lhandle->handle->data = NULL;
-            lhandle->status = 1;
-            _close_handle(lhandle->handle);
+            _set_status(lhandle, 1);
+            _close_handle(lhandle->handle, lhandle->started);
         }
 
         _KILL_REFS(lhandle)
+        _fetch_done(L, lhandle);
 
         if(lhandle->status == 2)
         {
@@ -348,6 +1123,18 @@ static int _handle_gc(lua_State* L)
         }
     }
     //else printf("GC %s lhandle=%p handle=%p\n", lhandle->type, lhandle, lhandle->handle);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, lhandle->co.waitref);
+    luaL_unref(L, LUA_REGISTRYINDEX, lhandle->co.eventsref);
+    lhandle->co.waitref = lhandle->co.eventsref = LUA_NOREF;
+
+    free(lhandle->conn.histograms);
+    lhandle->conn.histograms = NULL;
+    _stop_query_timer(lhandle);
+
+    _live_remove(lhandle);
+    _env_release(L, lhandle->state, 1);
+    _state_release(lhandle->state);
     return 0;
 }
 
@@ -362,15 +1149,15 @@ void odbxuv_lua_error(lua_State *L, int error, const char *message)
 }
 
 odbxuv_connection_t* _create_connection(lua_State* L) {
-    return (odbxuv_connection_t*)_handle_create(L, sizeof(odbxuv_connection_t), "odbxuv_connection_t")->handle;
+    return (odbxuv_connection_t*)_handle_create(L, ODBXUV_LUA_POOL_CONNECTION, "odbxuv_connection_t")->handle;
 }
 
 odbxuv_op_escape_t *_create_escape(lua_State *L) {
-    return (odbxuv_op_escape_t*)_handle_create(L, sizeof(odbxuv_op_escape_t), "odbxuv_op_escape_t")->handle;
+    return (odbxuv_op_escape_t*)_handle_create(L, ODBXUV_LUA_POOL_ESCAPE, "odbxuv_op_escape_t")->handle;
 }
 
 odbxuv_op_query_t* _create_query(lua_State* L) {
-    return (odbxuv_op_query_t*)_handle_create(L, sizeof(odbxuv_op_query_t), "odbxuv_op_query_t")->handle;
+    return (odbxuv_op_query_t*)_handle_create(L, ODBXUV_LUA_POOL_QUERY, "odbxuv_op_query_t")->handle;
 }
 
 
@@ -378,6 +1165,7 @@ int odbxuv_lua_create_handle(lua_State *L)
 {
     odbxuv_connection_t *connection = _create_connection(L); 
     odbxuv_init_connection(connection, _get_loop(L));
+    ((lua_odbxuv_handle_t *)connection->data)->started = 1;
     return 1;
 }
 
@@ -393,209 +1181,2104 @@ static int odbxuv_lua_set_handler(lua_State* L)
     return 0;
 }
 
-static void _lua_after_connect(odbxuv_op_connect_t *op, int status)
+/* native.setEventSource(fn), callbacks are called as fn(name, callback, args...).
+ * nil or false calls them directly, errors are then only reported on stderr */
+static int odbxuv_lua_set_event_source(lua_State* L)
 {
-    /* load the lua state and the userdata */
-    lua_State* L = _op_get_lua(op->connection->data);
+    odbxuv_lua_state_t* state = _get_state(L);
 
-    if (status < ODBX_ERR_SUCCESS)
+    if(!lua_isnoneornil(L, 1) && !(lua_isboolean(L, 1) && !lua_toboolean(L, 1)))
     {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, state->eventSourceRef);
+    state->eventSourceRef = LUA_NOREF;
+    state->resolved = 1;
+
+    if(lua_isfunction(L, 1))
+    {
+        lua_pushvalue(L, 1);
+        state->eventSourceRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    return 0;
+}
+
+static void _dispatch_queued_queries(lua_State *L, lua_odbxuv_handle_t *lconnection);
+static void _fail_queued_queries(lua_State *L, lua_odbxuv_handle_t *lconnection, const char *message);
+
+static void _lua_after_connect(odbxuv_op_connect_t *op, int status)
+{
+    /* load the lua state and the userdata */
+    lua_State* L = _op_get_lua(op->connection->data);
+
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)op->connection->data;
+
+    lhandle->conn.connecting = 0;
+
+    if (status < ODBX_ERR_SUCCESS)
+    {
+        _fail_queued_queries(L, lhandle, "Connecting failed");
         _push_async_error(L, (odbxuv_handle_t *)op, "after_connect", NULL);
-        _emit_event(L, "error", 1);
+        _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
         odbxuv_free_error((odbxuv_handle_t *)op);
     }
     else
     {
-        _emit_event(L, "connect", 0);
+        lua_pushvalue(L, -1);
+        _emit_event(L, ODBXUV_LUA_EVENT_CONNECT, 0);
+        _dispatch_queued_queries(L, lhandle);
+        lua_pop(L, 1);
+    }
+    HANDLE_UNREF(L, lhandle);
+    odbxuv_free_handle((odbxuv_handle_t *)op);
+    _pool_free(op);
+}
+
+int odbxuv_lua_connect(lua_State* L)
+{
+    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+
+    const char *backend = luaL_checkstring(L, 2);
+    const char *host    = luaL_checkstring(L, 3);
+    const char *port    = lua_tostring(L, 4);
+
+    const char *database= luaL_checkstring(L, 5);
+    const char *user    = luaL_checkstring(L, 6);
+    const char *password= luaL_checkstring(L, 7);
+
+    int method          = lua_tonumber(L, 8);
+
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)handle->data;
+    if(strcmp(backend, "sqlite3") == 0 || strcmp(backend, "sqlite") == 0)
+    {
+        lhandle->conn.dialect = ODBXUV_LUA_DIALECT_SQLITE;
+    }
+    else
+    {
+        lhandle->conn.dialect = ODBXUV_LUA_DIALECT_NONE;
+    }
+
+    odbxuv_op_connect_t *op = (odbxuv_op_connect_t *)_pool_alloc(lhandle->state, ODBXUV_LUA_POOL_CONNECT);
+
+    op->backend = backend;
+    op->host = host;
+    op->port = port;
+    op->database = database;
+    op->password = password;
+    op->user = user;
+    op->method = method;
+
+    int err = odbxuv_connect(handle, op, _lua_after_connect);
+
+    if (err < ODBX_ERR_SUCCESS)
+    {
+        _pool_free(op);
+        return luaL_error(L, "odbxuv_connect: %i", err);
+    }
+
+    lhandle->conn.connecting = 1;
+
+    HANDLE_REF(L, handle->data, 1);
+
+    return 0;
+}
+
+static void _lua_after_escape(odbxuv_op_escape_t *op, int status)
+{
+    lua_State* L = _op_get_lua(op->data);
+    
+    if (status < ODBX_ERR_SUCCESS)
+    {
+        _push_async_error(L, (odbxuv_handle_t *)op, "escape", NULL);
+        _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
+    }
+    else
+    {
+        lua_pushstring(L, op->string);
+        _emit_event(L, ODBXUV_LUA_EVENT_ESCAPE, 1);
+    }
+
+    HANDLE_UNREF(L, op->connection->data);
+    HANDLE_UNREF(L, op->data);
+
+    odbxuv_free_error((odbxuv_handle_t *)op);
+}
+
+int odbxuv_lua_escape(lua_State *L)
+{
+    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+
+    const char *escapeString = luaL_checkstring(L, 2);
+
+    if(handle->status != ODBXUV_CON_STATUS_CONNECTED)
+    {
+        luaL_error(L, "Handle is not connected!\n");
+    }
+
+    odbxuv_op_escape_t *escape = _create_escape(L);
+    ((lua_odbxuv_handle_t *)escape->data)->co.enabled = ((lua_odbxuv_handle_t *)handle->data)->co.enabled;
+
+    int err = odbxuv_escape(handle, escape, escapeString, _lua_after_escape);
+
+    if (err < ODBX_ERR_SUCCESS)
+    {
+        _handle_close((odbxuv_handle_t *)escape);
+        _set_status((lua_odbxuv_handle_t *)lua_touserdata(L, -1), 1);
+        return luaL_error(L, "odbxuv_query: %i", err);
+    }
+
+    ((lua_odbxuv_handle_t *)escape->data)->started = 1;
+
+    HANDLE_REF(L, handle->data, 1);
+    HANDLE_REF(L, escape->data, -1);
+
+    return 1;
+}
+
+static void _buffer_reserve(odbxuv_lua_buffer_t *buffer, size_t extra)
+{
+    size_t needed = buffer->length + extra + 1;
+    if(needed > buffer->size)
+    {
+        size_t size = buffer->size ? buffer->size : 256;
+        while(size < needed)
+        {
+            size *= 2;
+        }
+        buffer->data = (char *)realloc(buffer->data, size);
+        buffer->size = size;
+    }
+}
+
+static void _buffer_append(odbxuv_lua_buffer_t *buffer, const char *data, size_t length)
+{
+    _buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
+/* Appends the string escaped for use inside a quoted sqlite literal */
+static void _buffer_append_escaped(odbxuv_lua_buffer_t *buffer, const char *data, size_t length)
+{
+    size_t i;
+    char *out;
+
+    _buffer_reserve(buffer, length * 2);
+    out = buffer->data + buffer->length;
+
+    for(i = 0; i < length; i++)
+    {
+        char c = data[i];
+        if(c == '\'')
+        {
+            *out++ = '\'';
+        }
+        *out++ = c;
+    }
+
+    buffer->length = out - buffer->data;
+    buffer->data[buffer->length] = '\0';
+}
+
+/* native.escapeSync(connection, string) -> escaped string, or nil when the backend needs native.escape.
+ * Only sqlite3 escaping is fixed, mysql escaping depends on the connection charset
+ * and on NO_BACKSLASH_ESCAPES in sql_mode, which only the server knows */
+int odbxuv_lua_escape_sync(lua_State *L)
+{
+    size_t length;
+    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+    const char *escapeString = luaL_checklstring(L, 2, &length);
+    char dialect = ((lua_odbxuv_handle_t *)handle->data)->conn.dialect;
+
+    if(dialect != ODBXUV_LUA_DIALECT_SQLITE)
+    {
+        return 0;
+    }
+
+    odbxuv_lua_buffer_t *sql = &_get_state(L)->sql;
+
+    sql->length = 0;
+    _buffer_append_escaped(sql, escapeString, length);
+    lua_pushlstring(L, sql->data, sql->length);
+    return 1;
+}
+
+/* Gives the memory of the buffer to the spare list, or frees it, and leaves the buffer empty */
+static void _query_buffer_recycle(odbxuv_lua_query_buffer_t *buffer)
+{
+    odbxuv_lua_state_t *state = buffer->state;
+
+    if(!buffer->buffer.data)
+    {
+        return;
+    }
+
+    if(buffer->buffer.size <= ODBXUV_LUA_MAX_SPARE_BUFFER_SIZE && state->spareBuffers.count < ODBXUV_LUA_MAX_SPARE_BUFFERS)
+    {
+        buffer->buffer.length = 0;
+        state->spareBuffers.buffers[state->spareBuffers.count++] = buffer->buffer;
+    }
+    else
+    {
+        free(buffer->buffer.data);
+    }
+
+    buffer->buffer.data = NULL;
+    buffer->buffer.length = 0;
+    buffer->buffer.size = 0;
+}
+
+/* Makes room for extra more bytes, starting out with spare memory when the buffer has none */
+static void _query_buffer_reserve(odbxuv_lua_query_buffer_t *buffer, size_t extra)
+{
+    odbxuv_lua_state_t *state = buffer->state;
+
+    if(!buffer->buffer.data)
+    {
+        if(state->spareBuffers.count > 0)
+        {
+            buffer->buffer = state->spareBuffers.buffers[--state->spareBuffers.count];
+            state->spareBuffers.hits++;
+        }
+        else
+        {
+            state->spareBuffers.misses++;
+        }
+    }
+
+    _buffer_reserve(&buffer->buffer, extra);
+}
+
+/* Pushes a new empty query buffer */
+static odbxuv_lua_query_buffer_t *_query_buffer_create(lua_State *L, size_t size)
+{
+    odbxuv_lua_state_t *state = _get_state(L);
+    odbxuv_lua_query_buffer_t *buffer = (odbxuv_lua_query_buffer_t *)lua_newuserdata(L, sizeof(odbxuv_lua_query_buffer_t));
+    luaL_getmetatable(L, BUFFER_META_TABLE);
+    lua_setmetatable(L, -2);
+
+    buffer->buffer.data = NULL;
+    buffer->buffer.length = 0;
+    buffer->buffer.size = 0;
+    buffer->state = state;
+    buffer->busy = 0;
+
+    if(++state->spareBuffers.inUse > state->spareBuffers.highWater)
+    {
+        state->spareBuffers.highWater = state->spareBuffers.inUse;
+    }
+
+    _query_buffer_reserve(buffer, size);
+    return buffer;
+}
+
+static int _query_buffer_gc(lua_State *L)
+{
+    odbxuv_lua_query_buffer_t *buffer = (odbxuv_lua_query_buffer_t *)lua_touserdata(L, 1);
+
+    /* Queries pin their buffer, so none is collected while in use */
+    _query_buffer_recycle(buffer);
+    buffer->state->spareBuffers.inUse--;
+    _state_release(buffer->state);
+    return 0;
+}
+
+/* The query buffer at index or NULL */
+static odbxuv_lua_query_buffer_t *_to_query_buffer(lua_State *L, int index)
+{
+    odbxuv_lua_query_buffer_t *buffer = (odbxuv_lua_query_buffer_t *)lua_touserdata(L, index);
+
+    if(!buffer || !lua_getmetatable(L, index))
+    {
+        return NULL;
+    }
+
+    luaL_getmetatable(L, BUFFER_META_TABLE);
+    if(!lua_rawequal(L, -1, -2))
+    {
+        buffer = NULL;
+    }
+    lua_pop(L, 2);
+
+    return buffer;
+}
+
+/* The query buffer at index, which must not be in use by a query */
+static odbxuv_lua_query_buffer_t *_check_writable_buffer(lua_State *L, int index)
+{
+    odbxuv_lua_query_buffer_t *buffer = (odbxuv_lua_query_buffer_t *)luaL_checkudata(L, index, BUFFER_META_TABLE);
+
+    if(buffer->busy)
+    {
+        luaL_error(L, "Buffer is in use by a query");
+    }
+
+    return buffer;
+}
+
+/* native.buffer(size) -> empty query buffer with room for size bytes */
+int odbxuv_lua_buffer(lua_State *L)
+{
+    _query_buffer_create(L, (size_t)luaL_optinteger(L, 1, 0));
+    return 1;
+}
+
+/* native.bufferAppend(buffer, ...) appends the strings and numbers given */
+int odbxuv_lua_buffer_append(lua_State *L)
+{
+    odbxuv_lua_query_buffer_t *buffer = _check_writable_buffer(L, 1);
+    int i, top = lua_gettop(L);
+
+    for(i = 2; i <= top; i++)
+    {
+        size_t length;
+        const char *value = luaL_checklstring(L, i, &length);
+        _query_buffer_reserve(buffer, length);
+        _buffer_append(&buffer->buffer, value, length);
+    }
+
+    return 0;
+}
+
+/* native.bufferAppendList(buffer, list, separator) appends list[1] to list[#list] with separator in between */
+int odbxuv_lua_buffer_append_list(lua_State *L)
+{
+    odbxuv_lua_query_buffer_t *buffer = _check_writable_buffer(L, 1);
+    size_t separatorLength = 0;
+    const char *separator = luaL_optlstring(L, 3, "", &separatorLength);
+    int i, n;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_objlen(L, 2);
+
+    for(i = 1; i <= n; i++)
+    {
+        size_t length;
+        const char *value;
+
+        lua_rawgeti(L, 2, i);
+        value = lua_tolstring(L, -1, &length);
+        if(!value)
+        {
+            return luaL_error(L, "List item %d is a %s, not a string", i, lua_typename(L, lua_type(L, -1)));
+        }
+
+        _query_buffer_reserve(buffer, length + separatorLength);
+        if(i > 1)
+        {
+            _buffer_append(&buffer->buffer, separator, separatorLength);
+        }
+        _buffer_append(&buffer->buffer, value, length);
+        lua_pop(L, 1);
+    }
+
+    return 0;
+}
+
+/* native.bufferClear(buffer) empties the buffer keeping its memory */
+int odbxuv_lua_buffer_clear(lua_State *L)
+{
+    odbxuv_lua_query_buffer_t *buffer = _check_writable_buffer(L, 1);
+
+    buffer->buffer.length = 0;
+    if(buffer->buffer.data)
+    {
+        buffer->buffer.data[0] = '\0';
+    }
+    return 0;
+}
+
+int odbxuv_lua_buffer_length(lua_State *L)
+{
+    lua_pushinteger(L, ((odbxuv_lua_query_buffer_t *)luaL_checkudata(L, 1, BUFFER_META_TABLE))->buffer.length);
+    return 1;
+}
+
+/* native.bufferToString(buffer, maxLength) -> the text, or its first maxLength bytes */
+int odbxuv_lua_buffer_to_string(lua_State *L)
+{
+    odbxuv_lua_query_buffer_t *buffer = (odbxuv_lua_query_buffer_t *)luaL_checkudata(L, 1, BUFFER_META_TABLE);
+    size_t length = buffer->buffer.length;
+
+    if(lua_isnumber(L, 2) && (size_t)lua_tointeger(L, 2) < length)
+    {
+        length = (size_t)lua_tointeger(L, 2);
+    }
+
+    lua_pushlstring(L, buffer->buffer.data ? buffer->buffer.data : "", length);
+    return 1;
+}
+
+static int _histogram_bucket(uint64_t us)
+{
+    int msb = 0, index;
+
+    if(us < 4)
+    {
+        return (int)us;
+    }
+
+    while((us >> msb) > 1)
+    {
+        msb++;
+    }
+
+    index = (msb - 1) * 4 + (int)((us >> (msb - 2)) & 3);
+    return index < ODBXUV_LUA_HISTOGRAM_BUCKETS ? index : ODBXUV_LUA_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Upper bound of the values in a bucket */
+static uint64_t _histogram_bucket_limit(int index)
+{
+    int msb;
+
+    if(index < 4)
+    {
+        return index + 1;
+    }
+
+    msb = index / 4 + 1;
+    return ((uint64_t)1 << msb) + ((uint64_t)(index % 4 + 1) << (msb - 2));
+}
+
+static void _histogram_record(odbxuv_lua_histogram_t *histogram, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+
+    histogram->buckets[_histogram_bucket(us)]++;
+    histogram->count++;
+    histogram->sum += us;
+    if(us > histogram->max)
+    {
+        histogram->max = us;
+    }
+}
+
+static uint64_t _histogram_percentile(odbxuv_lua_histogram_t *histogram, double percentile)
+{
+    uint64_t rank = (uint64_t)(histogram->count * percentile), seen = 0;
+    uint64_t limit;
+    int i;
+
+    for(i = 0; i < ODBXUV_LUA_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if(seen > rank)
+        {
+            limit = _histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/* Pushes {count, mean, p50, p99, max} in milliseconds */
+static void _push_histogram(lua_State *L, odbxuv_lua_histogram_t *histogram)
+{
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, (lua_Number)histogram->count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, histogram->count ? histogram->sum / 1e3 / histogram->count : 0);
+    lua_setfield(L, -2, "mean");
+    lua_pushnumber(L, _histogram_percentile(histogram, 0.5) / 1e3);
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, _histogram_percentile(histogram, 0.99) / 1e3);
+    lua_setfield(L, -2, "p99");
+    lua_pushnumber(L, histogram->max / 1e3);
+    lua_setfield(L, -2, "max");
+}
+
+static odbxuv_lua_histograms_t *_connection_histograms(lua_odbxuv_handle_t *lconnection)
+{
+    if(!lconnection->conn.histograms)
+    {
+        lconnection->conn.histograms = (odbxuv_lua_histograms_t *)calloc(1, sizeof(odbxuv_lua_histograms_t));
+    }
+    return lconnection->conn.histograms;
+}
+
+static void _unqueue_query(lua_State *L, lua_odbxuv_handle_t *lhandle);
+
+/* Pushes the error of a query that timed out or was cancelled, code is "TIMEOUT" or "CANCELLED" */
+static void _push_abandon_error(lua_State *L, lua_odbxuv_handle_t *lhandle, int timedOut)
+{
+    if(timedOut)
+    {
+        lua_pushfstring(L, "Query timed out after %d ms", lhandle->query.timeout);
+    }
+    else
+    {
+        lua_pushstring(L, "Query was cancelled");
+    }
+    _push_async_error_raw(L, -ODBX_ERR_HANDLE, -1, lua_tostring(L, -1), "query", lhandle->query.sql);
+    lua_remove(L, -2);
+
+    lua_pushstring(L, timedOut ? "TIMEOUT" : "CANCELLED");
+    lua_setfield(L, -2, "code");
+}
+
+/* Gives up on a query that did not complete yet and emits the timeout or cancel error.
+ * Queued queries are dropped with their references. Running ones can not be taken back from
+ * the backend, their handlers are released now and the result is closed once it arrives */
+static int _abandon_query(lua_odbxuv_handle_t *lhandle, int timedOut)
+{
+    lua_State* L;
+
+    if(lhandle->query.done || lhandle->query.abandoned || !lhandle->refCount || lhandle->status != 0)
+    {
+        return 0;
+    }
+
+    _stop_query_timer(lhandle);
+    lhandle->query.abandoned = 1;
+
+    L = _op_get_lua(lhandle);
+    lua_pushvalue(L, -1);
+    _push_abandon_error(L, lhandle, timedOut);
+    _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
+
+    if(lhandle->query.queued)
+    {
+        lua_pop(L, 1);
+        _unqueue_query(L, lhandle);
+        return 1;
+    }
+
+    /* Drop the handlers, only the sql and the connection have to stay */
+    lua_getfenv(L, -1);
+    lua_pushnil(L);
+    while(lua_next(L, -2))
+    {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if(lua_isfunction(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, -4);
+        }
+        else
+        {
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 2);
+
+    return 1;
+}
+
+static void _lua_query_timeout(uv_timer_t *timer
+#if UV_VERSION_MAJOR < 1
+    , int status
+#endif
+    )
+{
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)timer->data;
+    _abandon_query(lhandle, 1);
+}
+
+/* native.cancel(query) -> true when the query was still pending */
+int odbxuv_lua_cancel(lua_State *L)
+{
+    _check_userdata(L, 1, "odbxuv_op_query_t");
+    lua_pushboolean(L, _abandon_query((lua_odbxuv_handle_t *)lua_touserdata(L, 1), 0));
+    return 1;
+}
+
+/* The backend is done with the sql. A query buffer is writable again, after a successful
+ * query it is emptied and its memory reused, a failed one leaves it intact for a retry */
+static void _release_query_sql(lua_odbxuv_handle_t *lhandle, int succeeded)
+{
+    odbxuv_lua_query_buffer_t *buffer = lhandle->query.buffer;
+
+    if(buffer)
+    {
+        buffer->busy = 0;
+        if(succeeded)
+        {
+            _query_buffer_recycle(buffer);
+        }
+        lhandle->query.buffer = NULL;
+        lhandle->query.sql = NULL;
+    }
+}
+
+static void _lua_after_query(odbxuv_op_query_t *op, int status)
+{
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)op->data;
+    lua_odbxuv_handle_t *lconnection = lhandle->query.connection;
+    lua_State* L = _op_get_lua(lhandle);
+
+    lhandle->query.done = uv_hrtime();
+    lconnection->conn.inFlight--;
+    _stop_query_timer(lhandle);
+
+    if(lhandle->query.abandoned)
+    {
+        /* Nobody waits for the result anymore */
+        lua_pop(L, 1);
+        _release_query_sql(lhandle, 0);
+        _dispatch_queued_queries(L, lconnection);
+        odbxuv_free_error((odbxuv_handle_t *)op);
+
+        if(lhandle->status == 0)
+        {
+            /* The reference held for the query is handed over to the close */
+            _set_status(lhandle, 1);
+        }
+        else
+        {
+            /* Closed by the user meanwhile, the close holds its own reference */
+            HANDLE_UNREF(L, lhandle);
+        }
+        HANDLE_UNREF(L, lconnection);
+        _close_handle((odbxuv_handle_t *)op, 1);
+        return;
+    }
+
+    if (status >= ODBX_ERR_SUCCESS)
+    {
+        odbxuv_lua_histograms_t *histograms = _connection_histograms(lconnection);
+        _histogram_record(&histograms->queueWait, lhandle->query.dispatched - lhandle->query.submitted);
+        _histogram_record(&histograms->execution, lhandle->query.done - lhandle->query.dispatched);
+    }
+
+    /* Keep the connection busy before handing control to lua */
+    _dispatch_queued_queries(L, lconnection);
+
+    if (status < ODBX_ERR_SUCCESS)
+    {
+        _push_async_error(L, (odbxuv_handle_t *)op, "after_query", op->query);
+        _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
+    }
+    else
+    {
+        _emit_event(L, ODBXUV_LUA_EVENT_QUERY, 0);
+
+    }
+
+    _release_query_sql(lhandle, status >= ODBX_ERR_SUCCESS);
+
+    HANDLE_UNREF(L, lconnection);
+    HANDLE_UNREF(L, lhandle);
+
+    odbxuv_free_error((odbxuv_handle_t *)op);
+}
+
+static int _dispatch_query(lua_odbxuv_handle_t *lconnection, lua_odbxuv_handle_t *lhandle)
+{
+    int err;
+
+    lhandle->query.dispatched = uv_hrtime();
+    lconnection->conn.inFlight++;
+
+    err = odbxuv_query((odbxuv_connection_t *)lconnection->handle, (odbxuv_op_query_t *)lhandle->handle, lhandle->query.sql, lhandle->query.flags, _lua_after_query);
+
+    if (err < ODBX_ERR_SUCCESS)
+    {
+        lconnection->conn.inFlight--;
+        return err;
+    }
+
+    lhandle->started = 1;
+    return err;
+}
+
+static int _can_dispatch(lua_odbxuv_handle_t *lconnection)
+{
+    return ((odbxuv_connection_t *)lconnection->handle)->status == ODBXUV_CON_STATUS_CONNECTED
+        && (lconnection->conn.maxInFlight <= 0 || lconnection->conn.inFlight < lconnection->conn.maxInFlight);
+}
+
+/* Takes the query out of its connection queue and drops the references held for it */
+static void _unqueue_query(lua_State *L, lua_odbxuv_handle_t *lhandle)
+{
+    lua_odbxuv_handle_t *lconnection = lhandle->query.connection;
+    lua_odbxuv_handle_t **link = &lconnection->conn.queue;
+    lua_odbxuv_handle_t *previous = NULL;
+
+    while(*link && *link != lhandle)
+    {
+        previous = *link;
+        link = &(*link)->query.next;
+    }
+
+    if(*link)
+    {
+        *link = lhandle->query.next;
+        if(lconnection->conn.queueTail == lhandle)
+        {
+            lconnection->conn.queueTail = previous;
+        }
+        lconnection->conn.queued--;
+    }
+
+    lhandle->query.next = NULL;
+    lhandle->query.queued = 0;
+    _stop_query_timer(lhandle);
+    _release_query_sql(lhandle, 0);
+
+    HANDLE_UNREF(L, lconnection);
+    HANDLE_UNREF(L, lhandle);
+}
+
+static lua_odbxuv_handle_t *_shift_queued_query(lua_odbxuv_handle_t *lconnection)
+{
+    lua_odbxuv_handle_t *lhandle = lconnection->conn.queue;
+
+    lconnection->conn.queue = lhandle->query.next;
+    if(!lconnection->conn.queue)
+    {
+        lconnection->conn.queueTail = NULL;
+    }
+    lconnection->conn.queued--;
+
+    lhandle->query.next = NULL;
+    lhandle->query.queued = 0;
+    return lhandle;
+}
+
+/* Emits an error on a query that could not be dispatched and drops its references */
+static void _fail_query(lua_odbxuv_handle_t *lhandle, int code, const char *message)
+{
+    lua_odbxuv_handle_t *lconnection = lhandle->query.connection;
+    lua_State* L = _op_get_lua(lhandle);
+
+    _stop_query_timer(lhandle);
+    _push_async_error_raw(L, code, -1, message, "after_query", lhandle->query.sql);
+    _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
+    _release_query_sql(lhandle, 0);
+
+    HANDLE_UNREF(L, lconnection);
+    HANDLE_UNREF(L, lhandle);
+}
+
+/* Hands queued queries to opendbxuv in order for as long as the connection allows */
+static void _dispatch_queued_queries(lua_State *L, lua_odbxuv_handle_t *lconnection)
+{
+    while(lconnection->conn.queue && _can_dispatch(lconnection))
+    {
+        lua_odbxuv_handle_t *lhandle = _shift_queued_query(lconnection);
+        int err = _dispatch_query(lconnection, lhandle);
+
+        if (err < ODBX_ERR_SUCCESS)
+        {
+            _fail_query(lhandle, err, odbx_error(NULL, err));
+        }
+    }
+}
+
+/* Fails every query still waiting in the queue */
+static void _fail_queued_queries(lua_State *L, lua_odbxuv_handle_t *lconnection, const char *message)
+{
+    while(lconnection->conn.queue)
+    {
+        _fail_query(_shift_queued_query(lconnection), -ODBX_ERR_HANDLE, message);
+    }
+}
+
+/* Starts a query on the connection at index 1 and pushes the query handle.
+ * Queries are queued while the connection is connecting or has maxInFlight queries running.
+ * The string or query buffer at sql_index is kept alive until the query handle is collected,
+ * a buffer is used in place and recycled once the backend is done with it */
+static int _query(lua_State *L, int sql_index, int flags, int options_index)
+{
+    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+    lua_odbxuv_handle_t *lconnection = (lua_odbxuv_handle_t *)handle->data;
+
+    odbxuv_lua_query_buffer_t *buffer = _to_query_buffer(L, sql_index);
+    const char *queryString;
+    char typed = 0;
+    int timeout = 0;
+
+    if(handle->status != ODBXUV_CON_STATUS_CONNECTED && !lconnection->conn.connecting)
+    {
+        luaL_error(L, "Handle is not connected!\n");
+    }
+
+    if(buffer)
+    {
+        if(buffer->busy)
+        {
+            luaL_error(L, "Buffer is in use by a query");
+        }
+        _query_buffer_reserve(buffer, 0);
+        queryString = buffer->buffer.data;
+    }
+    else
+    {
+        queryString = lua_tostring(L, sql_index);
+    }
+
+    if(options_index && lua_istable(L, options_index))
+    {
+        lua_getfield(L, options_index, "typed");
+        typed = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, options_index, "timeout");
+        timeout = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    odbxuv_op_query_t *query = _create_query(L);
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)query->data;
+    lhandle->fetch.typed = typed;
+    lhandle->co.enabled = lconnection->co.enabled;
+
+    /* Pin the query text to the handle for as long as the backend may use it,
+     * and the connection for recording statistics */
+    lua_getfenv(L, -1);
+    lua_pushvalue(L, sql_index);
+    lua_setfield(L, -2, "query");
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "connection");
+    lua_pop(L, 1);
+
+    lhandle->query.connection = lconnection;
+    lhandle->query.sql = queryString;
+    lhandle->query.buffer = buffer;
+    if(buffer)
+    {
+        buffer->busy = 1;
+    }
+    lhandle->query.flags = flags;
+    lhandle->query.submitted = uv_hrtime();
+
+    if(!lconnection->conn.queue && _can_dispatch(lconnection))
+    {
+        int err = _dispatch_query(lconnection, lhandle);
+
+        if (err < ODBX_ERR_SUCCESS)
+        {
+            _release_query_sql(lhandle, 0);
+            _handle_close((odbxuv_handle_t *)query);
+            _set_status(lhandle, 1);
+            return luaL_error(L, "odbxuv_query: %i", err);
+        }
+    }
+    else
+    {
+        lhandle->query.queued = 1;
+        if(lconnection->conn.queueTail)
+        {
+            lconnection->conn.queueTail->query.next = lhandle;
+        }
+        else
+        {
+            lconnection->conn.queue = lhandle;
+        }
+        lconnection->conn.queueTail = lhandle;
+        lconnection->conn.queued++;
+    }
+
+    HANDLE_REF(L, lconnection, 1);
+    HANDLE_REF(L, lhandle, -1);
+
+    /* The deadline covers the wait in the queue and the execution */
+    if(timeout > 0)
+    {
+        lhandle->query.timeout = timeout;
+        lhandle->query.timer = (uv_timer_t *)malloc(sizeof(uv_timer_t));
+        uv_timer_init(_get_loop(L), lhandle->query.timer);
+        lhandle->query.timer->data = lhandle;
+        uv_timer_start(lhandle->query.timer, _lua_query_timeout, timeout, 0);
+    }
+
+    return 1;
+}
+
+/* native.setMaxInFlight(connection, n), 0 removes the limit */
+int odbxuv_lua_set_max_in_flight(lua_State *L)
+{
+    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+    lua_odbxuv_handle_t *lconnection = (lua_odbxuv_handle_t *)handle->data;
+
+    lconnection->conn.maxInFlight = luaL_checkint(L, 2);
+    _dispatch_queued_queries(L, lconnection);
+    return 0;
+}
+
+/* native.queueInfo(connection) -> queued, inFlight */
+int odbxuv_lua_queue_info(lua_State *L)
+{
+    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+    lua_odbxuv_handle_t *lconnection = (lua_odbxuv_handle_t *)handle->data;
+
+    lua_pushinteger(L, lconnection->conn.queued);
+    lua_pushinteger(L, lconnection->conn.inFlight);
+    return 2;
+}
+
+/* native.queryStats(query) -> table of timings in milliseconds */
+int odbxuv_lua_query_stats(lua_State *L)
+{
+    odbxuv_op_query_t *handle = (odbxuv_op_query_t *)_check_userdata(L, 1, "odbxuv_op_query_t");
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)handle->data;
+
+    lua_createtable(L, 0, 18);
+    if(lhandle->query.dispatched)
+    {
+        lua_pushnumber(L, (lhandle->query.dispatched - lhandle->query.submitted) / 1e6);
+        lua_setfield(L, -2, "queueWait");
+    }
+    if(lhandle->query.done)
+    {
+        lua_pushnumber(L, (lhandle->query.done - lhandle->query.dispatched) / 1e6);
+        lua_setfield(L, -2, "execution");
+    }
+    if(lhandle->query.lastRow)
+    {
+        lua_pushnumber(L, (lhandle->query.lastRow - lhandle->query.done) / 1e6);
+        lua_setfield(L, -2, "fetch");
+    }
+
+    lua_pushnumber(L, lhandle->query.callbackTime / 1e6);
+    lua_setfield(L, -2, "callback");
+    lua_pushnumber(L, (lua_Number)lhandle->query.rows);
+    lua_setfield(L, -2, "rows");
+    lua_pushnumber(L, (lua_Number)lhandle->query.bytes);
+    lua_setfield(L, -2, "bytes");
+
+    /* Rows held back by a pause, copied out of the backend result */
+    lua_pushinteger(L, lhandle->fetch.queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushnumber(L, (lua_Number)lhandle->fetch.queuedBytes);
+    lua_setfield(L, -2, "queuedBytes");
+    lua_pushinteger(L, lhandle->fetch.maxQueued);
+    lua_setfield(L, -2, "maxQueued");
+    lua_pushnumber(L, (lua_Number)lhandle->fetch.maxQueuedBytes);
+    lua_setfield(L, -2, "maxQueuedBytes");
+
+    /* Timestamps in the clock of native.now */
+#define XX(name) \
+    if(lhandle->query.name) \
+    { \
+        lua_pushnumber(L, lhandle->query.name / 1e6); \
+        lua_setfield(L, -2, #name); \
+    }
+    XX(submitted)
+    XX(dispatched)
+    XX(done)
+    XX(firstRow)
+    XX(lastRow)
+    XX(closed)
+#undef XX
+
+    return 1;
+}
+
+/* native.connectionStats(connection, reset) -> latency histograms of the queries of the connection */
+int odbxuv_lua_connection_stats(lua_State *L)
+{
+    lua_odbxuv_handle_t *lconnection;
+    odbxuv_lua_histograms_t *histograms;
+
+    _check_userdata(L, 1, "odbxuv_connection_t");
+    lconnection = (lua_odbxuv_handle_t *)lua_touserdata(L, 1);
+    histograms = _connection_histograms(lconnection);
+
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, (lua_Number)histograms->execution.count);
+    lua_setfield(L, -2, "queries");
+    _push_histogram(L, &histograms->queueWait);
+    lua_setfield(L, -2, "queueWait");
+    _push_histogram(L, &histograms->execution);
+    lua_setfield(L, -2, "execution");
+    _push_histogram(L, &histograms->fetch);
+    lua_setfield(L, -2, "fetch");
+    _push_histogram(L, &histograms->callback);
+    lua_setfield(L, -2, "callback");
+
+    if(lua_toboolean(L, 2))
+    {
+        memset(histograms, 0, sizeof(odbxuv_lua_histograms_t));
+    }
+
+    return 1;
+}
+
+/* native.query(connection, sql, flags, options) -> query handle, sql is a string or a query buffer */
+int odbxuv_lua_query(lua_State *L)
+{
+    if(!_to_query_buffer(L, 2))
+    {
+        luaL_checkstring(L, 2);
+    }
+    return _query(L, 2, lua_tonumber(L, 3), 4);
+}
+
+/* Appends the lua value at index as an sql literal */
+static void _buffer_append_value(lua_State *L, odbxuv_lua_buffer_t *buffer, int index, const char *name, int position)
+{
+    size_t length;
+    const char *value;
+
+    switch(lua_type(L, index))
+    {
+        case LUA_TNUMBER:
+        {
+            char number[32];
+            double n = lua_tonumber(L, index);
+
+            /* NaN and infinities have no sql literal */
+            if(n != n || n - n != 0)
+            {
+                if(name)
+                {
+                    luaL_error(L, "Parameter :%s can not be bound: %f", name, n);
+                }
+                luaL_error(L, "Parameter %d can not be bound: %f", position, n);
+            }
+
+            /* Integers are written in full, other values with enough digits to read back the same double */
+            if(n > -9.2e18 && n < 9.2e18 && n == (double)(long long)n)
+            {
+                length = snprintf(number, sizeof(number), "%lld", (long long)n);
+            }
+            else
+            {
+                length = snprintf(number, sizeof(number), "%.17g", n);
+            }
+            _buffer_append(buffer, number, length);
+            break;
+        }
+
+        case LUA_TSTRING:
+            value = lua_tolstring(L, index, &length);
+            _buffer_append(buffer, "'", 1);
+            _buffer_append_escaped(buffer, value, length);
+            _buffer_append(buffer, "'", 1);
+            break;
+
+        case LUA_TBOOLEAN:
+            _buffer_append(buffer, lua_toboolean(L, index) ? "1" : "0", 1);
+            break;
+
+        case LUA_TTABLE:
+            lua_getfield(L, LUA_REGISTRYINDEX, "odbxuv_null");
+            if(lua_rawequal(L, -1, index))
+            {
+                lua_pop(L, 1);
+                _buffer_append(buffer, "NULL", 4);
+                break;
+            }
+            lua_pop(L, 1);
+            /* fall through */
+
+        default:
+            if(name)
+            {
+                luaL_error(L, "Parameter :%s can not be bound: %s", name, lua_typename(L, lua_type(L, index)));
+            }
+            else
+            {
+                luaL_error(L, "Parameter %d can not be bound: %s", position, lua_typename(L, lua_type(L, index)));
+            }
+    }
+}
+
+static int _is_name_start(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static int _is_name_char(char c)
+{
+    return _is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+/* Splits sql at its ? and :name placeholders, skipping quoted text and comments */
+static void _statement_parse(odbxuv_lua_statement_t *statement, const char *sql, size_t length)
+{
+    size_t i = 0, textStart = 0, names = 0;
+    int position = 0;
+
+    statement->sql = (char *)malloc(length + 1);
+    memcpy(statement->sql, sql, length);
+    statement->sql[length] = '\0';
+
+    /* Every placeholder takes at least one character, and every name is shorter than the sql */
+    statement->placeholders = (odbxuv_lua_placeholder_t *)malloc(sizeof(odbxuv_lua_placeholder_t) * (length + 1));
+    statement->names = (char *)malloc(length + 1);
+    statement->count = 0;
+
+    while(i < length)
+    {
+        char c = sql[i];
+
+        if(c == '\'' || c == '"' || c == '`')
+        {
+            /* Quotes are escaped by doubling them, which simply reads as two quoted parts */
+            for(i++; i < length && sql[i] != c; i++)
+            {
+                /* skip the quoted text */
+            }
+            i++;
+        }
+        else if(c == '-' && i + 1 < length && sql[i + 1] == '-')
+        {
+            while(i < length && sql[i] != '\n')
+            {
+                i++;
+            }
+        }
+        else if(c == '/' && i + 1 < length && sql[i + 1] == '*')
+        {
+            for(i += 2; i + 1 < length && !(sql[i] == '*' && sql[i + 1] == '/'); i++);
+            i += 2;
+        }
+        else if(c == '?' || (c == ':' && i + 1 < length && _is_name_start(sql[i + 1]) && (i == 0 || sql[i - 1] != ':')))
+        {
+            odbxuv_lua_placeholder_t *placeholder = &statement->placeholders[statement->count++];
+            placeholder->textStart = textStart;
+            placeholder->textLength = i - textStart;
+
+            if(c == '?')
+            {
+                placeholder->position = ++position;
+                placeholder->name = NULL;
+                i++;
+            }
+            else
+            {
+                size_t nameStart = ++i;
+                while(i < length && _is_name_char(sql[i]))
+                {
+                    i++;
+                }
+                placeholder->position = 0;
+                placeholder->name = statement->names + names;
+                memcpy(statement->names + names, sql + nameStart, i - nameStart);
+                names += i - nameStart;
+                statement->names[names++] = '\0';
+            }
+
+            textStart = i;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    statement->tailStart = textStart > length ? length : textStart;
+}
+
+static int _statement_gc(lua_State *L)
+{
+    odbxuv_lua_statement_t *statement = (odbxuv_lua_statement_t *)lua_touserdata(L, 1);
+    free(statement->sql);
+    free(statement->names);
+    free(statement->placeholders);
+    statement->sql = statement->names = NULL;
+    statement->placeholders = NULL;
+    return 0;
+}
+
+/* native.prepare(connection, sql) -> statement.
+ * Parameters are escaped in process, which is only safe where escaping is fixed (see native.escapeSync) */
+int odbxuv_lua_prepare(lua_State *L)
+{
+    size_t length;
+    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+    const char *sql = luaL_checklstring(L, 2, &length);
+
+    if(((lua_odbxuv_handle_t *)handle->data)->conn.dialect != ODBXUV_LUA_DIALECT_SQLITE)
+    {
+        luaL_error(L, "Parameter binding is only supported for sqlite3, escape values with Connection:escape");
+    }
+
+    odbxuv_lua_statement_t *statement = (odbxuv_lua_statement_t *)lua_newuserdata(L, sizeof(odbxuv_lua_statement_t));
+    memset(statement, 0, sizeof(odbxuv_lua_statement_t));
+    luaL_getmetatable(L, STATEMENT_META_TABLE);
+    lua_setmetatable(L, -2);
+
+    /* The statement belongs to the connection */
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "connection");
+    lua_setfenv(L, -2);
+
+    _statement_parse(statement, sql, length);
+
+    return 1;
+}
+
+/* Splices the parameters at index 2 into the statement at index 1 and replaces the
+ * statement with its connection, the sql is left in buffer */
+static void _statement_build(lua_State *L, odbxuv_lua_buffer_t *buffer)
+{
+    int i;
+    odbxuv_lua_statement_t *statement = (odbxuv_lua_statement_t *)luaL_checkudata(L, 1, STATEMENT_META_TABLE);
+
+    if(!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+
+    /* Replace the statement with its connection */
+    lua_getfenv(L, 1);
+    lua_getfield(L, -1, "connection");
+    lua_replace(L, 1);
+    lua_pop(L, 1);
+
+    buffer->length = 0;
+    for(i = 0; i < statement->count; i++)
+    {
+        odbxuv_lua_placeholder_t *placeholder = &statement->placeholders[i];
+        _buffer_append(buffer, statement->sql + placeholder->textStart, placeholder->textLength);
+
+        if(lua_isnil(L, 2))
+        {
+            lua_pushnil(L);
+        }
+        else if(placeholder->name)
+        {
+            lua_getfield(L, 2, placeholder->name);
+        }
+        else
+        {
+            lua_rawgeti(L, 2, placeholder->position);
+        }
+
+        if(lua_isnil(L, -1))
+        {
+            buffer->length = 0;
+            if(placeholder->name)
+            {
+                luaL_error(L, "Missing parameter :%s", placeholder->name);
+            }
+            luaL_error(L, "Missing parameter %d", placeholder->position);
+        }
+
+        _buffer_append_value(L, buffer, -1, placeholder->name, placeholder->position);
+        lua_pop(L, 1);
+    }
+    _buffer_append(buffer, statement->sql + statement->tailStart, strlen(statement->sql + statement->tailStart));
+}
+
+/* native.format(statement, params) -> sql with the parameters spliced in */
+int odbxuv_lua_format(lua_State *L)
+{
+    lua_settop(L, 2);
+    odbxuv_lua_buffer_t *sql = &_get_state(L)->sql;
+
+    _statement_build(L, sql);
+    lua_pushlstring(L, sql->data, sql->length);
+    return 1;
+}
+
+/* native.execute(statement, params, flags, options) -> query handle.
+ * The sql is built in a query buffer, reusing the memory of completed queries */
+int odbxuv_lua_execute(lua_State *L)
+{
+    odbxuv_lua_query_buffer_t *buffer;
+    int flags = lua_tonumber(L, 3);
+
+    lua_settop(L, 4);
+    buffer = _query_buffer_create(L, 0);
+    _statement_build(L, &buffer->buffer);
+
+    return _query(L, 5, flags, 4);
+}
+
+static char _column_kind(int type)
+{
+    switch(type)
+    {
+        case ODBX_TYPE_SMALLINT:
+        case ODBX_TYPE_INTEGER:
+        case ODBX_TYPE_BIGINT:
+            return ODBXUV_LUA_KIND_INTEGER;
+
+        case ODBX_TYPE_REAL:
+        case ODBX_TYPE_DOUBLE:
+        case ODBX_TYPE_FLOAT:
+            return ODBXUV_LUA_KIND_NUMBER;
+
+        case ODBX_TYPE_BOOLEAN:
+            return ODBXUV_LUA_KIND_BOOLEAN;
+
+        default:
+            return ODBXUV_LUA_KIND_STRING;
+    }
+}
+
+/* Remembers how to push each column, called once the column info is known */
+static void _capture_column_kinds(odbxuv_op_query_t *result, lua_odbxuv_handle_t* lhandle)
+{
+    int i;
+
+    if(!lhandle->fetch.typed || lhandle->fetch.kinds || !result->columns || result->columnCount <= 0)
+    {
+        return;
+    }
+
+    lhandle->fetch.kinds = (char *)malloc(result->columnCount);
+    for(i = 0; i < result->columnCount; i++)
+    {
+        lhandle->fetch.kinds[i] = _column_kind(result->columns[i].type);
+    }
+}
+
+/* Interns the column names once for named rows, called once the column info is known */
+static void _capture_column_names(lua_State* L, odbxuv_op_query_t *result, lua_odbxuv_handle_t* lhandle)
+{
+    int i;
+
+    if(!lhandle->fetch.named || lhandle->fetch.namesref != LUA_NOREF || !result->columns)
+    {
+        return;
+    }
+
+    lua_createtable(L, result->columnCount, 0);
+    for(i = 0; i < result->columnCount; i++)
+    {
+        lua_pushstring(L, result->columns[i].name);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lhandle->fetch.namesref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* Pushes a value of a numeric or boolean column, returns 0 when it does not parse */
+static int _push_typed_value(lua_State* L, char kind, const char *value, size_t length)
+{
+    char *end;
+
+    if(length == 0)
+    {
+        return 0;
+    }
+
+    switch(kind)
+    {
+        case ODBXUV_LUA_KIND_INTEGER:
+        {
+            long long n = strtoll(value, &end, 10);
+            if(end != value + length || n > ODBXUV_LUA_MAX_EXACT_INTEGER || n < -ODBXUV_LUA_MAX_EXACT_INTEGER)
+            {
+                return 0;
+            }
+            lua_pushnumber(L, (lua_Number)n);
+            return 1;
+        }
+
+        case ODBXUV_LUA_KIND_NUMBER:
+        {
+            double n = strtod(value, &end);
+            if(end != value + length)
+            {
+                return 0;
+            }
+            lua_pushnumber(L, n);
+            return 1;
+        }
+
+        case ODBXUV_LUA_KIND_BOOLEAN:
+            lua_pushboolean(L, value[0] == '1' || value[0] == 't' || value[0] == 'T' || value[0] == 'y' || value[0] == 'Y');
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Pushes a single column value, NULL columns become the NULL sentinel.
+ * Backends that report value lengths get binary safe strings */
+static void _push_column_value(lua_State* L, lua_odbxuv_handle_t* lhandle, odbxuv_row_t *row, int i)
+{
+    const char *value = row->value[i];
+    size_t length;
+
+    if(value == NULL)
+    {
+        lua_getfield(L, LUA_REGISTRYINDEX, "odbxuv_null");
+        return;
+    }
+
+#ifdef ODBXUV_ROW_HAS_LENGTH
+    length = row->length[i];
+#else
+    length = strlen(value);
+#endif
+    lhandle->query.bytes += length;
+
+    if(lhandle->fetch.kinds && lhandle->fetch.kinds[i] != ODBXUV_LUA_KIND_STRING
+        && _push_typed_value(L, lhandle->fetch.kinds[i], value, length))
+    {
+        return;
+    }
+
+    lua_pushlstring(L, value, length);
+}
+
+/* Pushes every column of the row and returns the amount of values pushed */
+static int _push_row_values(lua_State* L, odbxuv_op_query_t *result, odbxuv_row_t *row)
+{
+    int i = 0;
+    if(row->value)
+    {
+        lua_checkstack(L, result->columnCount + 1);
+        for(i = 0; i < result->columnCount; i++)
+        {
+            _push_column_value(L, (lua_odbxuv_handle_t *)result->data, row, i);
+        }
+    }
+    return i;
+}
+
+/* Pushes the row as an array of column values, or keyed by column name in named mode */
+static void _push_row_table(lua_State* L, odbxuv_op_query_t *result, odbxuv_row_t *row)
+{
+    int i;
+    lua_odbxuv_handle_t* lhandle = (lua_odbxuv_handle_t *)result->data;
+
+    if(lhandle->fetch.namesref != LUA_NOREF)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->fetch.namesref);
+        lua_createtable(L, 0, result->columnCount);
+        if(row->value)
+        {
+            for(i = 0; i < result->columnCount; i++)
+            {
+                lua_rawgeti(L, -2, i + 1);
+                _push_column_value(L, lhandle, row, i);
+                lua_rawset(L, -3);
+            }
+        }
+        /* Remove the names */
+        lua_remove(L, -2);
+        return;
+    }
+
+    lua_createtable(L, result->columnCount, 0);
+    if(row->value)
+    {
+        for(i = 0; i < result->columnCount; i++)
+        {
+            _push_column_value(L, lhandle, row, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+}
+
+/* Emits the collected rows as a single "rows" event, expects the userdata on top of the stack */
+static void _flush_batch(lua_State* L, lua_odbxuv_handle_t* lhandle)
+{
+    int pending = lhandle->fetch.pending;
+
+    if(pending == 0)
+    {
+        return;
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->fetch.rowsref);
+    lua_pushinteger(L, pending);
+    _drop_batch(L, lhandle);
+    _emit_event(L, ODBXUV_LUA_EVENT_ROWS, 2);
+}
+
+/* Pauses delivery once the high water mark is reached, expects the userdata on top of the stack */
+static void _check_high_water_mark(lua_State* L, lua_odbxuv_handle_t* lhandle)
+{
+    if(lhandle->fetch.highWaterMark <= 0 || ++lhandle->fetch.delivered < lhandle->fetch.highWaterMark)
+    {
+        return;
+    }
+
+    _flush_batch(L, lhandle);
+    lhandle->fetch.paused = 1;
+    lua_pushvalue(L, -1);
+    _emit_event(L, ODBXUV_LUA_EVENT_PAUSE, 0);
+}
+
+/* Frees the arrays of a columnar result, not the result itself */
+static void _columnar_free(odbxuv_lua_columnar_t* columnar)
+{
+    int i;
+
+    for(i = 0; i < columnar->columnCount && columnar->columns; i++)
+    {
+        odbxuv_lua_column_t *column = &columnar->columns[i];
+        free(column->integers);
+        free(column->numbers);
+        free(column->offsets);
+        free(column->bytes);
+        free(column->nulls);
+    }
+    free(columnar->columns);
+    columnar->columns = NULL;
+    columnar->columnCount = 0;
+    columnar->rowCount = 0;
+}
+
+static int _columnar_gc(lua_State *L)
+{
+    _columnar_free((odbxuv_lua_columnar_t *)lua_touserdata(L, 1));
+    return 0;
+}
+
+static void _columnar_create(odbxuv_op_query_t *result, lua_odbxuv_handle_t* lhandle)
+{
+    int i;
+    odbxuv_lua_columnar_t *columnar = (odbxuv_lua_columnar_t *)malloc(sizeof(odbxuv_lua_columnar_t));
+
+    columnar->rowCount = 0;
+    columnar->columnCount = result->columns ? result->columnCount : 0;
+    columnar->columns = (odbxuv_lua_column_t *)calloc(columnar->columnCount > 0 ? columnar->columnCount : 1, sizeof(odbxuv_lua_column_t));
+    for(i = 0; i < columnar->columnCount; i++)
+    {
+        columnar->columns[i].kind = _column_kind(result->columns[i].type);
+    }
+
+    lhandle->fetch.columnar = columnar;
+}
+
+static void _column_reserve_bytes(odbxuv_lua_column_t* column, size_t length)
+{
+    if(column->byteLength + length <= column->byteCapacity)
+    {
+        return;
+    }
+
+    column->byteCapacity = column->byteCapacity ? column->byteCapacity * 2 : 4096;
+    while(column->byteCapacity < column->byteLength + length)
+    {
+        column->byteCapacity *= 2;
+    }
+    column->bytes = (char *)realloc(column->bytes, column->byteCapacity);
+}
+
+/* Makes room for at least rows values, doubling the arrays */
+static void _column_grow(odbxuv_lua_column_t* column, size_t rows)
+{
+    size_t capacity = column->capacity ? column->capacity : 1024;
+    size_t nullBytes = (column->capacity + 7) / 8;
+
+    while(capacity < rows)
+    {
+        capacity *= 2;
+    }
+
+    switch(column->kind)
+    {
+        case ODBXUV_LUA_KIND_INTEGER:
+        case ODBXUV_LUA_KIND_BOOLEAN:
+            column->integers = (int64_t *)realloc(column->integers, capacity * sizeof(int64_t));
+            break;
+        case ODBXUV_LUA_KIND_NUMBER:
+            column->numbers = (double *)realloc(column->numbers, capacity * sizeof(double));
+            break;
+        default:
+            column->offsets = (size_t *)realloc(column->offsets, (capacity + 1) * sizeof(size_t));
+            if(column->capacity == 0)
+            {
+                column->offsets[0] = 0;
+            }
+            break;
+    }
+
+    column->nulls = (uint8_t *)realloc(column->nulls, (capacity + 7) / 8);
+    memset(column->nulls + nullBytes, 0, (capacity + 7) / 8 - nullBytes);
+    column->capacity = capacity;
+}
+
+/* Turns the first rows values of a numeric column into text, used when a value does not parse */
+static void _column_demote(odbxuv_lua_column_t* column, size_t rows)
+{
+    size_t i;
+    char text[32];
+    int length;
+
+    column->offsets = (size_t *)malloc((column->capacity + 1) * sizeof(size_t));
+    column->offsets[0] = 0;
+
+    for(i = 0; i < rows; i++)
+    {
+        length = 0;
+        if(!(column->nulls[i >> 3] & (1 << (i & 7))))
+        {
+            if(column->kind == ODBXUV_LUA_KIND_NUMBER)
+            {
+                length = snprintf(text, sizeof(text), "%.17g", column->numbers[i]);
+            }
+            else
+            {
+                length = snprintf(text, sizeof(text), "%lld", (long long)column->integers[i]);
+            }
+            _column_reserve_bytes(column, length);
+            memcpy(column->bytes + column->byteLength, text, length);
+            column->byteLength += length;
+        }
+        column->offsets[i + 1] = column->byteLength;
+    }
+
+    free(column->integers);
+    free(column->numbers);
+    column->integers = NULL;
+    column->numbers = NULL;
+    column->kind = ODBXUV_LUA_KIND_STRING;
+}
+
+/* Appends one value to its column, NULL values leave a zero or empty value behind */
+static void _column_append(odbxuv_lua_column_t* column, size_t n, const char *value, size_t length)
+{
+    char *end;
+
+    if(n >= column->capacity)
+    {
+        _column_grow(column, n + 1);
+    }
+
+    if(value == NULL)
+    {
+        column->nulls[n >> 3] |= 1 << (n & 7);
+        length = 0;
+    }
+
+    switch(column->kind)
+    {
+        case ODBXUV_LUA_KIND_INTEGER:
+            if(value == NULL)
+            {
+                column->integers[n] = 0;
+                return;
+            }
+            column->integers[n] = strtoll(value, &end, 10);
+            if(length > 0 && end == value + length)
+            {
+                return;
+            }
+            break;
+
+        case ODBXUV_LUA_KIND_NUMBER:
+            if(value == NULL)
+            {
+                column->numbers[n] = 0;
+                return;
+            }
+            column->numbers[n] = strtod(value, &end);
+            if(length > 0 && end == value + length)
+            {
+                return;
+            }
+            break;
+
+        case ODBXUV_LUA_KIND_BOOLEAN:
+            column->integers[n] = value != NULL && (value[0] == '1' || value[0] == 't' || value[0] == 'T' || value[0] == 'y' || value[0] == 'Y');
+            return;
+    }
+
+    if(column->kind != ODBXUV_LUA_KIND_STRING)
+    {
+        _column_demote(column, n);
+    }
+
+    if(length > 0)
+    {
+        _column_reserve_bytes(column, length);
+        memcpy(column->bytes + column->byteLength, value, length);
+        column->byteLength += length;
+    }
+    column->offsets[n + 1] = column->byteLength;
+}
+
+/* Appends a row to the columns and returns the bytes of its values */
+static size_t _columnar_append(odbxuv_lua_columnar_t* columnar, odbxuv_row_t *row)
+{
+    int i;
+    const char *value;
+    size_t length, bytes = 0;
+
+    for(i = 0; i < columnar->columnCount; i++)
+    {
+        value = row->value ? row->value[i] : NULL;
+        length = 0;
+        if(value)
+        {
+#ifdef ODBXUV_ROW_HAS_LENGTH
+            length = row->length[i];
+#else
+            length = strlen(value);
+#endif
+        }
+        _column_append(&columnar->columns[i], columnar->rowCount, value, length);
+        bytes += length;
+    }
+    columnar->rowCount++;
+    return bytes;
+}
+
+/* Moves the collected result into a userdata, the ffi reads it in place */
+static void _columnar_push(lua_State* L, lua_odbxuv_handle_t* lhandle)
+{
+    odbxuv_lua_columnar_t *columnar = (odbxuv_lua_columnar_t *)lua_newuserdata(L, sizeof(odbxuv_lua_columnar_t));
+
+    memcpy(columnar, lhandle->fetch.columnar, sizeof(odbxuv_lua_columnar_t));
+    free(lhandle->fetch.columnar);
+    lhandle->fetch.columnar = NULL;
+
+    luaL_getmetatable(L, COLUMNAR_META_TABLE);
+    lua_setmetatable(L, -2);
+}
+
+static void _deliver_fetch(odbxuv_op_query_t *result, odbxuv_row_t *row, int status, int first)
+{
+    lua_odbxuv_handle_t* lhandle = (lua_odbxuv_handle_t *)result->data;
+    lua_State* L = _op_get_lua(lhandle);
+
+    if (status < ODBX_ERR_SUCCESS)
+    {
+        _fetch_done(L, lhandle);
+        HANDLE_UNREF(L, lhandle);
+        _push_async_error(L, (odbxuv_handle_t *)result, "fetch", NULL);
+        _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
+        return;
+    }
+
+    if(first)
+    {
+        _capture_column_kinds(result, lhandle);
+        _capture_column_names(L, result, lhandle);
+        if(lhandle->fetch.wantColumnar)
+        {
+            _columnar_create(result, lhandle);
+        }
+        lua_pushvalue(L, -1);
+        _emit_event(L, ODBXUV_LUA_EVENT_FETCH, 0);
+    }
+
+    if(row && lhandle->fetch.columnar)
+    {
+        lhandle->query.bytes += _columnar_append(lhandle->fetch.columnar, row);
+
+        /* Remove the userdata */
+        lua_pop(L, 1);
+    }
+    else if(row)
+    {
+        uint64_t started = uv_hrtime();
+
+        if(lhandle->fetch.batch > 0)
+        {
+            if(lhandle->fetch.rowsref == LUA_NOREF)
+            {
+                lua_createtable(L, lhandle->fetch.batch, 0);
+                lhandle->fetch.rowsref = luaL_ref(L, LUA_REGISTRYINDEX);
+            }
+
+            lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->fetch.rowsref);
+            _push_row_table(L, result, row);
+            lua_rawseti(L, -2, ++lhandle->fetch.pending);
+            lua_pop(L, 1);
+
+            if(lhandle->fetch.pending >= lhandle->fetch.batch)
+            {
+                _flush_batch(L, lhandle);
+            }
+        }
+        else
+        {
+            lua_pushvalue(L, -1);
+            if(lhandle->fetch.namesref != LUA_NOREF)
+            {
+                _push_row_table(L, result, row);
+                _emit_event(L, ODBXUV_LUA_EVENT_ROW, 1);
+            }
+            else
+            {
+                _emit_event(L, ODBXUV_LUA_EVENT_ROW, _push_row_values(L, result, row));
+            }
+        }
+
+        _check_high_water_mark(L, lhandle);
+        lhandle->query.callbackTime += uv_hrtime() - started;
+
+        /* Remove the userdata */
+        lua_pop(L, 1);
+    }
+    else
+    {
+        uint64_t started = uv_hrtime();
+        odbxuv_lua_histograms_t *histograms;
+
+        _flush_batch(L, lhandle);
+        lhandle->query.callbackTime += uv_hrtime() - started;
+
+        histograms = _connection_histograms(lhandle->query.connection);
+        _histogram_record(&histograms->fetch, lhandle->query.lastRow - lhandle->query.done);
+        _histogram_record(&histograms->callback, lhandle->query.callbackTime);
+
+        if(lhandle->fetch.columnar)
+        {
+            lua_pushvalue(L, -1);
+            _columnar_push(L, lhandle);
+            _emit_event(L, ODBXUV_LUA_EVENT_COLUMNAR, 1);
+        }
+        _fetch_done(L, lhandle);
+        _emit_event(L, ODBXUV_LUA_EVENT_FETCHED, 0);
+        HANDLE_UNREF(L, lhandle);
     }
-    HANDLE_UNREF(L, op->connection->data);
-    odbxuv_free_handle((odbxuv_handle_t *)op);
-    free(op);
 }
 
-int odbxuv_lua_connect(lua_State* L)
+/* Copies a fetch callback to the end of the queue of a paused query,
+ * returns 0 without copying when the row would exceed the queue limit */
+static int _queue_fetch(lua_odbxuv_handle_t* lhandle, odbxuv_op_query_t *result, odbxuv_row_t *row, int status, int first)
 {
-    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
+    int i, columns = row && row->value ? result->columnCount : 0;
+    size_t size = sizeof(odbxuv_lua_queued_row_t) + columns * (sizeof(char *) + sizeof(unsigned long));
+    unsigned long *lengths;
+    odbxuv_lua_queued_row_t *queued;
+    char *data;
 
-    const char *backend = luaL_checkstring(L, 2);
-    const char *host    = luaL_checkstring(L, 3);
-    const char *port    = lua_tostring(L, 4);
+    for(i = 0; i < columns; i++)
+    {
+        if(row->value[i])
+        {
+#ifdef ODBXUV_ROW_HAS_LENGTH
+            size += row->length[i] + 1;
+#else
+            size += strlen(row->value[i]) + 1;
+#endif
+        }
+    }
 
-    const char *database= luaL_checkstring(L, 5);
-    const char *user    = luaL_checkstring(L, 6);
-    const char *password= luaL_checkstring(L, 7);
+    if(row && lhandle->fetch.queueLimit && lhandle->fetch.queuedBytes + size > lhandle->fetch.queueLimit)
+    {
+        return 0;
+    }
 
-    int method          = lua_tonumber(L, 8);
+    queued = (odbxuv_lua_queued_row_t *)malloc(size);
+    memset(queued, 0, sizeof(odbxuv_lua_queued_row_t));
+    queued->size = size;
+    queued->status = status;
+    queued->first = first;
+    queued->end = row == NULL;
 
-    odbxuv_op_connect_t *op = malloc(sizeof(odbxuv_op_connect_t));
+    if(columns)
+    {
+        queued->row.value = (char **)(queued + 1);
+        lengths = (unsigned long *)(queued->row.value + columns);
+        data = (char *)(lengths + columns);
 
-    op->backend = backend;
-    op->host = host;
-    op->port = port;
-    op->database = database;
-    op->password = password;
-    op->user = user;
-    op->method = method;
+        for(i = 0; i < columns; i++)
+        {
+            if(row->value[i] == NULL)
+            {
+                queued->row.value[i] = NULL;
+                continue;
+            }
 
-    int err = odbxuv_connect(handle, op, _lua_after_connect);
+#ifdef ODBXUV_ROW_HAS_LENGTH
+            lengths[i] = row->length[i];
+#else
+            lengths[i] = strlen(row->value[i]);
+#endif
+            queued->row.value[i] = data;
+            memcpy(data, row->value[i], lengths[i]);
+            data[lengths[i]] = '\0';
+            data += lengths[i] + 1;
+        }
 
-    if (err < ODBX_ERR_SUCCESS)
-    {
-        free(op);
-        return luaL_error(L, "odbxuv_connect: %i", err);
+#ifdef ODBXUV_ROW_HAS_LENGTH
+        queued->row.length = lengths;
+#endif
     }
 
-    HANDLE_REF(L, handle->data, 1);
-
-    return 0;
-}
-
-static void _lua_after_escape(odbxuv_op_escape_t *op, int status)
-{
-    lua_State* L = _op_get_lua(op->data);
-    
-    if (status < ODBX_ERR_SUCCESS)
+    if(lhandle->fetch.queueTail)
     {
-        _push_async_error(L, (odbxuv_handle_t *)op, "escape", NULL);
-        _emit_event(L, "error", 1);
+        lhandle->fetch.queueTail->next = queued;
     }
     else
     {
-        lua_pushstring(L, op->string);
-        _emit_event(L, "escape", 1);
+        lhandle->fetch.queue = queued;
     }
+    lhandle->fetch.queueTail = queued;
+    lhandle->fetch.queued++;
+    lhandle->fetch.queuedBytes += size;
 
-    HANDLE_UNREF(L, op->connection->data);
-    HANDLE_UNREF(L, op->data);
-
-    odbxuv_free_error((odbxuv_handle_t *)op);
+    if(lhandle->fetch.queued > lhandle->fetch.maxQueued)
+    {
+        lhandle->fetch.maxQueued = lhandle->fetch.queued;
+    }
+    if(lhandle->fetch.queuedBytes > lhandle->fetch.maxQueuedBytes)
+    {
+        lhandle->fetch.maxQueuedBytes = lhandle->fetch.queuedBytes;
+    }
+    return 1;
 }
 
-int odbxuv_lua_escape(lua_State *L)
+/* Fails a paused query whose queue hit its limit. The backend can not be stopped,
+ * the rest of the result is dropped as it arrives */
+static void _overflow_fetch(lua_odbxuv_handle_t* lhandle)
 {
-    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
-
-    const char *escapeString = luaL_checkstring(L, 2);
+    lua_State* L = _op_get_lua(lhandle);
 
-    if(handle->status != ODBXUV_CON_STATUS_CONNECTED)
-    {
-        luaL_error(L, "Handle is not connected!\n");
-    }
+    lhandle->fetch.overflowed = 1;
+    lhandle->fetch.paused = 0;
+    _fetch_done(L, lhandle);
 
-    odbxuv_op_escape_t *escape = _create_escape(L);
+    lua_pushfstring(L, "Query held more than %d bytes of rows while paused", (int)lhandle->fetch.queueLimit);
+    _push_async_error_raw(L, -ODBX_ERR_NOMEM, -1, lua_tostring(L, -1), "fetch", lhandle->query.sql);
+    lua_remove(L, -2);
+    lua_pushstring(L, "QUEUE_LIMIT");
+    lua_setfield(L, -2, "code");
+    _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
+}
 
-    int err = odbxuv_escape(handle, escape, escapeString, _lua_after_escape);
+/* Delivers queued callbacks until the queue is empty or the query is paused again */
+static void _drain_fetch_queue(odbxuv_op_query_t *result)
+{
+    lua_odbxuv_handle_t* lhandle = (lua_odbxuv_handle_t *)result->data;
 
-    if (err < ODBX_ERR_SUCCESS)
+    while(!lhandle->fetch.paused && lhandle->fetch.queue)
     {
-        _handle_close((odbxuv_handle_t *)escape);
-        return luaL_error(L, "odbxuv_query: %i", err);
-    }
+        odbxuv_lua_queued_row_t *queued = lhandle->fetch.queue;
 
-    HANDLE_REF(L, handle->data, 1);
-    HANDLE_REF(L, escape->data, -1);
+        lhandle->fetch.queue = queued->next;
+        if(!lhandle->fetch.queue)
+        {
+            lhandle->fetch.queueTail = NULL;
+        }
+        lhandle->fetch.queued--;
+        lhandle->fetch.queuedBytes -= queued->size;
 
-    return 1;
+        _deliver_fetch(result, queued->end ? NULL : &queued->row, queued->status, queued->first);
+        free(queued);
+    }
 }
 
-static void _lua_after_query(odbxuv_op_query_t *op, int status)
+void _lua_after_fetch(odbxuv_op_query_t *result, odbxuv_row_t *row, int status)
 {
-    lua_State* L = _op_get_lua(op->data);
+    lua_odbxuv_handle_t* lhandle = (lua_odbxuv_handle_t *)result->data;
+    int first = result->fetchCallbackStatus != ODBXUV_FETCH_CB_STATUS_CALLED;
 
-    if (status < ODBX_ERR_SUCCESS)
+    if(row)
     {
-        _push_async_error(L, (odbxuv_handle_t *)op, "after_query", op->query);
-        _emit_event(L, "error", 1);
+        lhandle->query.rows++;
+        if(!lhandle->query.firstRow)
+        {
+            lhandle->query.firstRow = uv_hrtime();
+        }
     }
     else
     {
-        _emit_event(L, "query", 0);
+        lhandle->query.lastRow = uv_hrtime();
+    }
 
+    if(lhandle->fetch.overflowed)
+    {
+        /* Release the reference of native.fetch once the backend is done */
+        if(!row || status < ODBX_ERR_SUCCESS)
+        {
+            HANDLE_UNREF(lhandle->L, lhandle);
+        }
+        return;
     }
 
-    HANDLE_UNREF(L, op->connection->data);
-    HANDLE_UNREF(L, op->data);
+    /* Keep the order when rows are still queued from an earlier pause */
+    if(lhandle->fetch.paused || lhandle->fetch.queue)
+    {
+        if(!_queue_fetch(lhandle, result, row, status, first))
+        {
+            _overflow_fetch(lhandle);
+        }
+        return;
+    }
 
-    odbxuv_free_error((odbxuv_handle_t *)op);
+    _deliver_fetch(result, row, status, first);
 }
 
-int odbxuv_lua_query(lua_State *L)
+int odbxuv_lua_fetch(lua_State *L)
 {
-    odbxuv_connection_t *handle = (odbxuv_connection_t *)_check_userdata(L, 1, "odbxuv_connection_t");
-
-    const char *queryString = luaL_checkstring(L, 2);
-    int flags = lua_tonumber(L, 3);
+    odbxuv_op_query_t *handle = (odbxuv_op_query_t *)_check_userdata(L, 1, "odbxuv_op_query_t");
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)handle->data;
 
-    if(handle->status != ODBXUV_CON_STATUS_CONNECTED)
+    if(lhandle->query.abandoned)
     {
-        luaL_error(L, "Handle is not connected!\n");
+        return luaL_error(L, "Query timed out or was cancelled");
     }
 
-    odbxuv_op_query_t *query = _create_query(L);
+    if(lua_istable(L, 2))
+    {
+        lua_getfield(L, 2, "batch");
+        lhandle->fetch.batch = lua_tointeger(L, -1);
+        lua_pop(L, 1);
 
-    int err = odbxuv_query(handle, query, queryString, flags, _lua_after_query);
+        lua_getfield(L, 2, "named");
+        lhandle->fetch.named = lua_toboolean(L, -1);
+        lua_pop(L, 1);
 
-    if (err < ODBX_ERR_SUCCESS)
-    {
-        _handle_close((odbxuv_handle_t *)query);
-        return luaL_error(L, "odbxuv_connect: %i", err);
+        lua_getfield(L, 2, "highWaterMark");
+        lhandle->fetch.highWaterMark = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "queueLimit");
+        if(lua_isnumber(L, -1))
+        {
+            lhandle->fetch.queueLimit = (size_t)lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "columnar");
+        lhandle->fetch.wantColumnar = lua_toboolean(L, -1);
+        lua_pop(L, 1);
     }
 
-    HANDLE_REF(L, handle->data, 1);
-    HANDLE_REF(L, query->data, -1);
+    HANDLE_REF(L, lhandle, 1);
+    lua_pop(L, 1);
 
-    return 1;
+    odbxuv_query_process(handle, _lua_after_fetch);
+
+    return 0;
 }
 
-void _lua_after_fetch(odbxuv_op_query_t *result, odbxuv_row_t *row, int status)
+/* Holds back rows of the query until native.resume is called. opendbxuv keeps fetching
+ * meanwhile, the rows it hands over are copied into the fetch queue until the queue limit
+ * of native.fetch is hit, the query then fails with an error whose code is "QUEUE_LIMIT" */
+int odbxuv_lua_pause(lua_State *L)
 {
-    lua_State* L = _op_get_lua(result->data);
-
-    if (status < ODBX_ERR_SUCCESS)
-    {
-        HANDLE_UNREF(L, result->data);
-        _push_async_error(L, (odbxuv_handle_t *)result, "fetch", NULL);
-        _emit_event(L, "error", 1);
-        return;
-    }
+    odbxuv_op_query_t *handle = (odbxuv_op_query_t *)_check_userdata(L, 1, "odbxuv_op_query_t");
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)handle->data;
 
-    if(result->fetchCallbackStatus != ODBXUV_FETCH_CB_STATUS_CALLED)
+    if(!lhandle->fetch.paused)
     {
-        lua_pushvalue(L, -1);
-        _emit_event(L, "fetch", 0);
+        lhandle->fetch.paused = 1;
     }
 
-    if(row)
-    {
-        int i = 0;
-        if(row->value)
-        {
-            for(i = 0; i < result->columnCount; i++)
-            {
-                lua_pushstring(L, row->value[i]);
-            }
-        }
-        _emit_event(L, "row", i);
-    }
-    else
-    {
-        lua_State* L = _op_get_lua(result->data);
-        _emit_event(L, "fetched", 0);
-        HANDLE_UNREF(L, result->data);
-    }
+    return 0;
 }
 
-int odbxuv_lua_fetch(lua_State *L)
+/* Delivers the rows held back while paused before returning */
+int odbxuv_lua_resume(lua_State *L)
 {
     odbxuv_op_query_t *handle = (odbxuv_op_query_t *)_check_userdata(L, 1, "odbxuv_op_query_t");
-    HANDLE_REF(L, handle->data, 1);
-    lua_pop(L, 1);
+    lua_odbxuv_handle_t *lhandle = (lua_odbxuv_handle_t *)handle->data;
 
-    odbxuv_query_process(handle, _lua_after_fetch);
+    if(lhandle->fetch.paused)
+    {
+        lhandle->fetch.paused = 0;
+        lhandle->fetch.delivered = 0;
+        _drain_fetch_queue(handle);
+    }
 
     return 0;
 }
 
+/* native.queuedRows(query) -> rows held back by a pause */
+int odbxuv_lua_queued_rows(lua_State *L)
+{
+    odbxuv_op_query_t *handle = (odbxuv_op_query_t *)_check_userdata(L, 1, "odbxuv_op_query_t");
+    lua_pushinteger(L, ((lua_odbxuv_handle_t *)handle->data)->fetch.queued);
+    return 1;
+}
+
 int odbxuv_lua_query_column_count(lua_State *L)
 {
     odbxuv_op_query_t *handle = (odbxuv_op_query_t *)_check_userdata(L, 1, "odbxuv_op_query_t");
@@ -643,16 +3326,16 @@ static void _lua_after_disconnect(odbxuv_op_disconnect_t *op, int status)
     if (status < ODBX_ERR_SUCCESS)
     {
         _push_async_error(L, (odbxuv_handle_t *)op, "after_disconnect", NULL);
-        _emit_event(L, "error", 1);
+        _emit_event(L, ODBXUV_LUA_EVENT_ERROR, 1);
         odbxuv_free_error((odbxuv_handle_t *)op);
     }
     else
     {
-        _emit_event(L, "disconnect", 0);
+        _emit_event(L, ODBXUV_LUA_EVENT_DISCONNECT, 0);
     }
 
     odbxuv_free_handle((odbxuv_handle_t *)op);
-    free(op);
+    _pool_free(op);
 }
 
 int odbxuv_lua_disconnect(lua_State *L)
@@ -664,7 +3347,9 @@ int odbxuv_lua_disconnect(lua_State *L)
         luaL_error(L, "Handle is not connected!\n");
     }
 
-    odbxuv_op_disconnect_t *op = (odbxuv_op_disconnect_t *)malloc(sizeof(odbxuv_op_disconnect_t));
+    _fail_queued_queries(L, (lua_odbxuv_handle_t *)handle->data, "Connection is disconnecting");
+
+    odbxuv_op_disconnect_t *op = (odbxuv_op_disconnect_t *)_pool_alloc(((lua_odbxuv_handle_t *)handle->data)->state, ODBXUV_LUA_POOL_DISCONNECT);
 
     odbxuv_disconnect(handle, op, _lua_after_disconnect);
 
@@ -686,43 +3371,203 @@ int odbxuv_lua_close (lua_State *L)
     HANDLE_REF(L, handle->data, 1);
 
     // Make sure to mark as closing
-    lhandle->status = 1;
+    _set_status(lhandle, 1);
+    lhandle->query.closed = uv_hrtime();
+    _stop_query_timer(lhandle);
+
+    if(lhandle->query.abandoned && !lhandle->query.done && lhandle->started)
+    {
+        /* Closed once the backend returns */
+        return 0;
+    }
+
+    if(lhandle->query.queued)
+    {
+        _unqueue_query(L, lhandle);
+    }
 
-    _close_handle(handle);
+    _close_handle(handle, lhandle->started);
+
+    return 0;
+}
 
+/* native.setCoroutineMode(handle, enabled), queries and escapes inherit the mode of their connection */
+int odbxuv_lua_set_coroutine_mode(lua_State *L)
+{
+    _check_userdata(L, 1, "handle");
+    ((lua_odbxuv_handle_t *)lua_touserdata(L, 1))->co.enabled = lua_toboolean(L, 2);
     return 0;
 }
 
+/* native.await(handle) -> event name, args...
+ * Returns the oldest event of a handle in coroutine mode, yielding the calling coroutine until one arrives */
+int odbxuv_lua_await(lua_State *L)
+{
+    lua_odbxuv_handle_t *lhandle;
+    int i, n;
+
+    _check_userdata(L, 1, "handle");
+    lhandle = (lua_odbxuv_handle_t *)lua_touserdata(L, 1);
+
+    if(!lhandle->co.enabled)
+    {
+        return luaL_error(L, "Handle is not in coroutine mode");
+    }
+
+    if(lhandle->co.head <= lhandle->co.tail)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lhandle->co.eventsref);
+        lua_rawgeti(L, -1, lhandle->co.head);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, lhandle->co.head++);
+
+        lua_getfield(L, -1, "n");
+        n = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        lua_checkstack(L, n);
+        for(i = 1; i <= n; i++)
+        {
+            lua_rawgeti(L, -i, i);
+        }
+        return n;
+    }
+
+    if(lhandle->co.waitref != LUA_NOREF)
+    {
+        return luaL_error(L, "Another coroutine is already waiting on this handle");
+    }
+
+    if(lua_pushthread(L))
+    {
+        return luaL_error(L, "native.await has to be called from a coroutine");
+    }
+    lhandle->co.waitref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return lua_yield(L, 0);
+}
+
 int odbxuv_lua_get_env(lua_State *L)
 {
     lua_getfenv(L, 1);
     return 1;
 }
 
-static void _dump_open_handles_loop(uv_handle_t *handle, void* arg)
+static const char *_status_names[3] = { "open", "closing", "closed" };
+
+/* native.handles(minAge) -> counts of the live handles of this lua_State by type and status.
+ * With minAge (ms) the handles alive for at least that long are listed as well, oldest first */
+int odbxuv_lua_handles(lua_State *L)
 {
-    int i = 0;
-    #define XX(_, name) if(handle->type == ++i) printf("HANDLE: %p %p %s (%i)\n", handle, handle->data, #name, i-1);
-    UV_HANDLE_TYPE_MAP(XX)
+    int i, j, n = 0;
+    uint64_t now = uv_hrtime();
+    lua_odbxuv_handle_t *lhandle;
+    odbxuv_lua_live_t *live = &_get_state(L)->live;
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, live->count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, live->leaked);
+    lua_setfield(L, -2, "leaked");
+    lua_pushnumber(L, live->head ? (now - live->head->live.created) / 1e6 : 0);
+    lua_setfield(L, -2, "oldest");
+
+    lua_createtable(L, 0, 3);
+    for(i = 0; i < ODBXUV_LUA_POOL_COUNT; i++)
+    {
+        if(i == ODBXUV_LUA_POOL_CONNECT || i == ODBXUV_LUA_POOL_DISCONNECT)
+        {
+            /* Plain ops without a lua handle */
+            continue;
+        }
+
+        lua_createtable(L, 0, 3);
+        for(j = 0; j < 3; j++)
+        {
+            lua_pushinteger(L, live->counts[i][j]);
+            lua_setfield(L, -2, _status_names[j]);
+        }
+        lua_setfield(L, -2, _pool_templates[i].name);
+    }
+    lua_setfield(L, -2, "types");
+
+    if(lua_isnumber(L, 1))
+    {
+        uint64_t minAge = (uint64_t)(lua_tonumber(L, 1) * 1e6);
+
+        lua_newtable(L);
+        for(lhandle = live->head; lhandle && now - lhandle->live.created >= minAge; lhandle = lhandle->live.next)
+        {
+            lua_createtable(L, 0, 6);
+            lua_pushstring(L, _pool_templates[(int)lhandle->pool].name);
+            lua_setfield(L, -2, "type");
+            lua_pushstring(L, _status_names[(int)lhandle->status]);
+            lua_setfield(L, -2, "status");
+            lua_pushnumber(L, (now - lhandle->live.created) / 1e6);
+            lua_setfield(L, -2, "age");
+            lua_pushinteger(L, lhandle->refCount);
+            lua_setfield(L, -2, "refCount");
+            if(lhandle->pool == ODBXUV_LUA_POOL_QUERY)
+            {
+                if(lhandle->query.sql)
+                {
+                    lua_pushstring(L, lhandle->query.sql);
+                    lua_setfield(L, -2, "sql");
+                }
+                lua_pushboolean(L, lhandle->query.queued);
+                lua_setfield(L, -2, "queued");
+                lua_pushnumber(L, (lua_Number)lhandle->query.rows);
+                lua_setfield(L, -2, "rows");
+            }
+            lua_rawseti(L, -2, ++n);
+        }
+        lua_setfield(L, -2, "long");
+    }
+
+    return 1;
 }
 
-int odbxuv_lua_dump_open_handles(lua_State *L)
+/* Monotonic time in milliseconds */
+int odbxuv_lua_now(lua_State *L)
 {
-    uv_walk(_get_loop(L), _dump_open_handles_loop, NULL);
-    return 0;
+    lua_pushnumber(L, uv_hrtime() / 1e6);
+    return 1;
 }
 
 static const luaL_reg functions[] = {
     { "setHandler",         odbxuv_lua_set_handler },
+    { "setEventSource",     odbxuv_lua_set_event_source },
     { "createHandle",       odbxuv_lua_create_handle },
     { "connect",            odbxuv_lua_connect },
     { "escape",             odbxuv_lua_escape },
+    { "escapeSync",         odbxuv_lua_escape_sync },
     { "query",              odbxuv_lua_query },
+    { "setMaxInFlight",     odbxuv_lua_set_max_in_flight },
+    { "queueInfo",          odbxuv_lua_queue_info },
+    { "queryStats",         odbxuv_lua_query_stats },
+    { "cancel",             odbxuv_lua_cancel },
+    { "connectionStats",    odbxuv_lua_connection_stats },
+    { "prepare",            odbxuv_lua_prepare },
+    { "execute",            odbxuv_lua_execute },
+    { "format",             odbxuv_lua_format },
+    { "buffer",             odbxuv_lua_buffer },
+    { "bufferAppend",       odbxuv_lua_buffer_append },
+    { "bufferAppendList",   odbxuv_lua_buffer_append_list },
+    { "bufferClear",        odbxuv_lua_buffer_clear },
+    { "bufferLength",       odbxuv_lua_buffer_length },
+    { "bufferToString",     odbxuv_lua_buffer_to_string },
     { "fetch",              odbxuv_lua_fetch},
+    { "pause",              odbxuv_lua_pause },
+    { "resume",             odbxuv_lua_resume },
+    { "queuedRows",         odbxuv_lua_queued_rows },
     { "disconnect",         odbxuv_lua_disconnect },
     { "close",              odbxuv_lua_close },
     { "getEnv",             odbxuv_lua_get_env },
-    { "check",              odbxuv_lua_dump_open_handles },
+    { "setCoroutineMode",   odbxuv_lua_set_coroutine_mode },
+    { "await",              odbxuv_lua_await },
+    { "handles",            odbxuv_lua_handles },
+    { "now",                odbxuv_lua_now },
+    { "poolStats",          odbxuv_lua_pool_stats },
     { "queryColumnCount",   odbxuv_lua_query_column_count },
     { "queryAffectedCount", odbxuv_lua_query_affected_count },
     { "queryColumnInfo",    odbxuv_lua_query_column_info },
@@ -738,10 +3583,69 @@ int luaopen_opendbxuv (lua_State* L)
     lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
 
+    /* Data of this lua_State, kept when the module is opened again */
+    if(!_get_state(L))
+    {
+        odbxuv_lua_state_t* state = (odbxuv_lua_state_t *)malloc(sizeof(odbxuv_lua_state_t));
+        memset(state, 0, sizeof(odbxuv_lua_state_t));
+        state->eventSourceRef = LUA_NOREF;
+        memcpy(state->pools, _pool_templates, sizeof(_pool_templates));
+
+        *(odbxuv_lua_state_t **)lua_newuserdata(L, sizeof(odbxuv_lua_state_t *)) = state;
+        luaL_newmetatable(L, STATE_META_TABLE);
+        lua_pushcfunction(L, _state_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, "odbxuv_state");
+
+        /* Callbacks run on the main thread, known to luvit as main_thread */
+        if(!_get_main_thread(L, state))
+        {
+            if(lua_pushthread(L))
+            {
+                state->main = L;
+            }
+            lua_pop(L, 1);
+        }
+
+        /* Spare handle environments */
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, "odbxuv_envs");
+    }
+
+    luaL_newmetatable(L, STATEMENT_META_TABLE);
+    lua_pushcfunction(L, _statement_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, COLUMNAR_META_TABLE);
+    lua_pushcfunction(L, _columnar_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, BUFFER_META_TABLE);
+    lua_pushcfunction(L, _query_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     lua_newtable (L);
 
     luaL_register(L, NULL, functions);
 
+    /* Sentinel for NULL column values, shared with the lua side */
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "odbxuv_null");
+    lua_setfield(L, -2, "NULL");
+
+    /* Whether column values are read with the lengths the backend reported */
+#ifdef ODBXUV_ROW_HAS_LENGTH
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
+#endif
+    lua_setfield(L, -2, "BINARY_SAFE");
+
     lua_pushstring(L, "Unkown version"); //TODO: implement
     lua_setfield(L, -2, "VERSION");
 
@@ -1,17 +1,112 @@
 local odbx = require "odbxuv"
+local native = require "opendbxuv"
 local bit = require "bit"
+local table = require "table"
+local timer = require "timer"
 local time = require "os".clock
 
 local createQueryBuilder = require "odbxuv.queryBuilder".createQueryBuilder
 
-local connection = odbx.createConnection({
+local credentials = {
     type        = "sqlite3",
     host        = "localhost",
     port        = nil,
     database    = "test",
     username    = "test",
     password    = "test"
-}, function(err, connection, ...)
+}
+
+local tests = {}
+
+-- Registers a focused test, fn(connection, done) runs on its own connection
+-- after the smoke test below, done(err) ends it
+local function test(name, fn)
+    tests[#tests+1] = {name = name, fn = fn}
+end
+
+local function runTests()
+    local i = 0
+
+    local function nextTest()
+        i = i + 1
+        local t = tests[i]
+        if not t then
+            return print(#tests .. " tests passed")
+        end
+
+        local finished = false
+        odbx.createConnection(credentials, function(err, connection)
+            if err then
+                error(t.name .. ": " .. tostring(err))
+            end
+
+            local guard = timer.setTimeout(10000, function()
+                error(t.name .. ": timed out")
+            end)
+
+            t.fn(connection, function(err)
+                assert(not finished, t.name .. ": done called twice")
+                finished = true
+                timer.clearTimer(guard)
+                if err then
+                    error(t.name .. ": " .. tostring(err))
+                end
+
+                print("ok " .. t.name)
+                connection:disconnect(function()
+                    connection:close()
+                    nextTest()
+                end)
+            end)
+        end)
+    end
+    nextTest()
+end
+
+-- Runs the statements one after another, callback(err) after the last one
+local function run(connection, statements, callback)
+    local i = 0
+    local function step(err, q)
+        if q then q:close() end
+        i = i + 1
+        if err or i > #statements then
+            return callback(err)
+        end
+        connection:query(statements[i], step)
+    end
+    step()
+end
+
+-- Reads the whole result of sql (sql text with options.params goes through execute),
+-- callback(err, rows, query)
+local function collect(connection, sql, options, callback)
+    options = options or {}
+    local result, finished = {}, false
+    connection:query(sql, options, function(err, query)
+        if finished then
+            return
+        end
+        if err then
+            finished = true
+            if query then query:close() end
+            return callback(err)
+        end
+
+        query:fetchBatch(64, function(rows, n)
+            for i = 1, n do
+                result[#result+1] = rows[i]
+            end
+        end, {named = options.named})
+        query:once("fetched", function()
+            finished = true
+            -- Still open in the callback, for its stats
+            callback(nil, result, query)
+            query:close()
+        end)
+    end)
+end
+
+local connection = odbx.createConnection(credentials, function(err, connection, ...)
     if err then
         error(err)
     end
@@ -87,7 +182,993 @@ local connection = odbx.createConnection({
 
 end):on("close", function(...)
     p("Closed connection", ...)
+    runTests()
 end):on("error", function(...)
     p("Connection error", ...)
     connection:close()
 end)
+
+test("fetchBatch hands out full blocks and the remainder", function(connection, done)
+    local sizes, total = {}, 0
+    connection:query("WITH RECURSIVE seq(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM seq LIMIT 10) SELECT x FROM seq;", function(err, query)
+        if err then return done(err) end
+
+        query:fetchBatch(4, function(rows, n)
+            sizes[#sizes+1] = n
+            for i = 1, n do
+                total = total + 1
+                assert(tonumber(rows[i][1]) == total, "rows out of order")
+            end
+        end)
+        query:once("fetched", function()
+            query:close()
+            assert(#sizes == 3 and sizes[1] == 4 and sizes[2] == 4 and sizes[3] == 2, "unexpected block sizes")
+            done()
+        end)
+    end)
+end)
+
+test("NULL columns are the NULL sentinel and blobs keep their bytes", function(connection, done)
+    collect(connection, "SELECT NULL, '', x'610062';", {}, function(err, rows)
+        if err then return done(err) end
+
+        local row = rows[1]
+        assert(row[1] == odbx.NULL, "NULL is not the sentinel")
+        assert(row[2] == "", "empty string is not empty")
+        -- Without backend reported lengths the value ends at its NUL byte
+        assert(row[3] == (odbx.BINARY_SAFE and "a\0b" or "a"), "blob value is wrong")
+        done()
+    end)
+end)
+
+test("typed columns are numbers, integers beyond 2^53 stay exact strings", function(connection, done)
+    run(connection, {
+        "DROP TABLE IF EXISTS typed_values;",
+        "CREATE TABLE typed_values (i INTEGER, r REAL, t TEXT, big BIGINT);",
+        "INSERT INTO typed_values VALUES (42, 2.5, '7', 9007199254740993);"
+    }, function(err)
+        if err then return done(err) end
+
+        collect(connection, "SELECT i, r, t, big FROM typed_values;", {typed = true}, function(err, rows)
+            if err then return done(err) end
+
+            local row = rows[1]
+            assert(row[1] == 42 and row[2] == 2.5, "numeric columns are not numbers")
+            assert(row[3] == "7", "text column was converted")
+            assert(row[4] == "9007199254740993", "big integer lost precision")
+
+            collect(connection, "SELECT i FROM typed_values;", {}, function(err, rows)
+                if err then return done(err) end
+                assert(rows[1][1] == "42", "untyped column is not a string")
+                done()
+            end)
+        end)
+    end)
+end)
+
+test("pool waiters that timed out are not counted", function(connection, done)
+    local pool = odbx.createPool(credentials, {max = 1, acquireTimeout = 50})
+
+    pool:acquire(function(err, first)
+        if err then return done(err) end
+
+        pool:acquire(function(err, second)
+            assert(err and not second, "second acquire did not time out")
+
+            local stats = pool:getStats()
+            assert(stats.waiters == 0, "timed out waiter is still counted")
+            assert(stats.timeouts == 1 and stats.size == 1, "unexpected pool stats")
+
+            pool:release(first)
+            assert(pool:getStats().idle == 1, "released connection is not idle")
+            pool:close()
+            done()
+        end)
+        assert(pool:getStats().waiters == 1, "waiter is not counted")
+    end)
+end)
+
+test("pool connect failures reach the waiter without an error listener", function(connection, done)
+    local pool = odbx.createPool({
+        type = "sqlite3",
+        database = "/nonexistent/odbxuv/test.db",
+        username = "test",
+        password = "test"
+    }, {retryDelay = 10})
+
+    pool:acquire(function(err, connection)
+        assert(err and not connection, "acquire did not fail")
+        assert(pool:getStats().errors == 1, "error was not counted")
+        pool:close()
+        done()
+    end)
+end)
+
+test("execute writes integer parameters in full", function(connection, done)
+    collect(connection, "SELECT ?, ?, ?;", {params = {2^60, 0.1, -12345678901234}}, function(err, rows)
+        if err then return done(err) end
+
+        local row = rows[1]
+        assert(row[1] == "1152921504606846976", "integer parameter was rounded")
+        assert(tonumber(row[2]) == 0.1, "fraction did not read back the same")
+        assert(row[3] == "-12345678901234", "negative integer parameter is wrong")
+        done()
+    end)
+end)
+
+test("escapeSync escapes quotes for sqlite3 and matches the backend", function(connection, done)
+    local value = "it's a \"test\" \\ done"
+    local escaped = connection:escapeSync(value)
+    assert(escaped == "it''s a \"test\" \\ done", "unexpected sqlite3 escape")
+
+    connection:escape(value, function(err, backend)
+        if err then return done(err) end
+        assert(backend == escaped, "escapeSync differs from the backend escape")
+
+        collect(connection, "SELECT '" .. escaped .. "';", {}, function(err, rows)
+            if err then return done(err) end
+            assert(rows[1][1] == value, "escaped value did not read back")
+            done()
+        end)
+    end)
+end)
+
+test("environments of collected handles are reused", function(connection, done)
+    local function createHandles(n)
+        for i = 1, n do
+            odbx.Connection:new()
+        end
+        collectgarbage()
+        collectgarbage()
+    end
+
+    createHandles(10)
+    local before = odbx.poolStats().env
+    assert(before.free >= 10, "collected handles did not give back their environment")
+
+    createHandles(10)
+    local after = odbx.poolStats().env
+    assert(after.hits - before.hits == 10, "environments were not reused")
+    assert(after.inUse == before.inUse, "environments are still counted in use")
+    done()
+end)
+
+test("setEventSource wraps every callback", function(connection, done)
+    local seen = {}
+    odbx.setEventSource(function(name, fn, ...)
+        seen[name] = (seen[name] or 0) + 1
+        return fn(...)
+    end)
+
+    run(connection, {"SELECT 1;", "SELECT 2;"}, function(err)
+        -- Back to the luvit event source, if there is one
+        odbx.setEventSource(eventSource)
+        if err then return done(err) end
+
+        assert(seen.query == 2, "query callbacks were not wrapped")
+        done()
+    end)
+end)
+
+test("named rows are keyed by column name", function(connection, done)
+    connection:query("SELECT 1 AS a, 'x' AS b, NULL AS c;", function(err, query)
+        if err then return done(err) end
+
+        local rows = 0
+        query:fetchNamed(function(row)
+            rows = rows + 1
+            assert(row.a == "1" and row.b == "x" and row.c == odbx.NULL, "named row is wrong")
+            assert(row[1] == nil, "named row has positional values")
+        end)
+        query:once("fetched", function()
+            query:close()
+            assert(rows == 1, "expected a single row")
+            done()
+        end)
+    end)
+end)
+
+test("highWaterMark pauses delivery until resume and reports held rows", function(connection, done)
+    connection:query("WITH RECURSIVE seq(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM seq LIMIT 100) SELECT x FROM seq;", function(err, query)
+        if err then return done(err) end
+
+        local received, paused = 0, false
+        query:on("row", function()
+            assert(not paused, "row delivered while paused")
+            received = received + 1
+        end)
+        query:on("pause", function()
+            paused = true
+            assert(received == 10, "paused after " .. received .. " rows")
+
+            -- The backend keeps fetching, its rows are held until resume
+            timer.setTimeout(20, function()
+                local stats = query:getStats()
+                assert(stats.queued > 0 and stats.queuedBytes > 0, "held rows are not reported")
+                paused = false
+                query:resume()
+            end)
+        end)
+        query:once("fetched", function()
+            local stats = query:getStats()
+            query:close()
+            assert(received == 100, "rows were lost: " .. received)
+            assert(stats.queued == 0 and stats.maxQueued > 0, "queue was not drained")
+            done()
+        end)
+        query:fetch(nil, {highWaterMark = 10})
+    end)
+end)
+
+test("queued queries complete in submission order", function(connection, done)
+    connection:setMaxInFlight(1)
+
+    local order = {}
+    for i = 1, 5 do
+        connection:query("SELECT " .. i .. ";", function(err, query)
+            if err then return done(err) end
+            query:close()
+
+            order[#order+1] = i
+            if i == 5 then
+                for j = 1, 5 do
+                    assert(order[j] == j, "queries completed out of order")
+                end
+                local queued, inFlight = connection:getQueueInfo()
+                assert(queued == 0 and inFlight == 0, "queue is not empty")
+                done()
+            end
+        end)
+    end
+
+    local queued, inFlight = connection:getQueueInfo()
+    assert(inFlight == 1 and queued == 4, "maxInFlight is not honoured")
+end)
+
+test("bulkInsert writes every row in chunks inside a transaction", function(connection, done)
+    run(connection, {
+        "DROP TABLE IF EXISTS bulk_rows;",
+        "CREATE TABLE bulk_rows (id INTEGER, name TEXT, note TEXT);"
+    }, function(err)
+        if err then return done(err) end
+
+        local writer = connection:bulkInsert("bulk_rows", {"id", "name", "note"}, {batchSize = 100})
+        for i = 1, 250 do
+            writer:write(i % 2 == 0 and {i, "it's " .. i} or {id = i, name = "row " .. i, note = "odd"})
+        end
+        writer:finish(function(err, stats)
+            if err then return done(err) end
+            assert(stats.rows == 250, "unexpected row count in stats")
+
+            collect(connection, "SELECT COUNT(*), SUM(note IS NULL), MAX(name) FROM bulk_rows WHERE id <= 250;", {}, function(err, rows)
+                if err then return done(err) end
+                assert(rows[1][1] == "250" and rows[1][2] == "125", "rows were not inserted as written")
+                assert(rows[1][3] == "row 99", "quoted values were not kept")
+                done()
+            end)
+        end)
+    end)
+end)
+
+test("coroutine API reads rows and raises errors", function(connection, done)
+    local co = require "odbxuv.co"
+
+    coroutine.wrap(function()
+        local c = co.connect(credentials)
+
+        local q = c:query("SELECT 1 UNION ALL SELECT 2;")
+        local values = {}
+        for value in q:rows() do
+            values[#values+1] = value
+        end
+        q:close()
+        assert(#values == 2 and values[1] == "1" and values[2] == "2", "unexpected rows")
+
+        -- LuaJIT yields across pcall
+        local ok, err = pcall(c.query, c, "SELECT FROM nowhere;")
+        assert(not ok and err, "invalid sql did not raise")
+
+        c:disconnect()
+        c:close()
+
+        -- Leave the coroutine before the next test starts
+        timer.setTimeout(0, function()
+            done()
+        end)
+    end)()
+end)
+
+test("coroutine execute reuses cached statements", function(connection, done)
+    local co = require "odbxuv.co"
+
+    coroutine.wrap(function()
+        local c = co.connect(credentials)
+
+        for i = 1, 2 do
+            local q = c:execute("SELECT ?;", {i})
+            local value = q:next()
+            q:close()
+            assert(value == tostring(i), "unexpected value")
+        end
+
+        local stats = c:getStatementCacheStats()
+        assert(stats.size == 1 and stats.misses == 1 and stats.hits == 1, "statement was prepared twice")
+
+        c:disconnect()
+        c:close()
+
+        timer.setTimeout(0, function()
+            done()
+        end)
+    end)()
+end)
+
+test("fetchColumnar collects typed column arrays and NULLs", function(connection, done)
+    run(connection, {
+        "DROP TABLE IF EXISTS columnar_values;",
+        "CREATE TABLE columnar_values (i INTEGER, r REAL, t TEXT);",
+        "INSERT INTO columnar_values VALUES (1, 1.5, 'a'), (2, NULL, 'bb'), (3, 2.5, NULL);"
+    }, function(err)
+        if err then return done(err) end
+
+        connection:query("SELECT i, r, t FROM columnar_values ORDER BY i;", function(err, query)
+            if err then return done(err) end
+
+            query:fetchColumnar(function(columns)
+                query:close()
+
+                assert(columns.rowCount == 3, "unexpected row count")
+                assert(columns:kind("i") == "integer" and columns:kind("r") == "number", "unexpected column kinds")
+                assert(columns:sum("i") == 6 and columns:sum("r") == 4, "sums are wrong")
+                assert(columns:isNull("r", 1) and columns:get("t", 2) == odbx.NULL, "NULL values are lost")
+                assert(columns:get("t", 1) == "bb" and columns:get(1, 2) == 3, "values are wrong")
+                done()
+            end)
+        end)
+    end)
+end)
+
+test("transactions commit batched statements and roll back failures", function(connection, done)
+    run(connection, {
+        "DROP TABLE IF EXISTS tx_rows;",
+        "CREATE TABLE tx_rows (id INTEGER);"
+    }, function(err)
+        if err then return done(err) end
+
+        local function ids(callback)
+            collect(connection, "SELECT id FROM tx_rows ORDER BY id;", {}, function(err, rows)
+                if err then return done(err) end
+                local list = {}
+                for i, row in ipairs(rows) do
+                    list[i] = row[1]
+                end
+                callback(table.concat(list, ","))
+            end)
+        end
+
+        connection:transaction(function(tx, finish)
+            tx:batch("INSERT INTO tx_rows VALUES (1);")
+            tx:batch("INSERT INTO tx_rows VALUES (?);", {2})
+            tx:query("SELECT COUNT(*) FROM tx_rows;", function(err, query)
+                if err then return finish(err) end
+                query:close()
+
+                -- Only the savepoint is rolled back
+                tx:savepoint(function(savepoint, release)
+                    savepoint:batch("INSERT INTO tx_rows VALUES (3);")
+                    savepoint:batch("INSERT INTO missing_table VALUES (4);")
+                    release()
+                end, function(err)
+                    assert(err, "failing savepoint did not report its error")
+                    finish()
+                end)
+            end)
+        end, function(err)
+            if err then return done(err) end
+
+            ids(function(committed)
+                assert(committed == "1,2", "commit kept " .. committed)
+
+                -- A failing batched statement must not let the ones before it commit
+                connection:transaction(function(tx, finish)
+                    tx:batch("INSERT INTO tx_rows VALUES (5);")
+                    tx:batch("INSERT INTO missing_table VALUES (6);")
+                    finish()
+                end, function(err)
+                    assert(err, "failing transaction reported no error")
+
+                    ids(function(committed)
+                        assert(committed == "1,2", "failed transaction was partly committed: " .. committed)
+                        done()
+                    end)
+                end)
+            end)
+        end)
+    end)
+end)
+
+test("queries record their timings and the connection its histograms", function(connection, done)
+    connection:getStats(true)
+
+    collect(connection, "SELECT 'abc' UNION ALL SELECT 'de';", {}, function(err, rows, query)
+        if err then return done(err) end
+
+        local stats = query:getStats()
+        assert(stats.rows == 2 and stats.bytes == 5, "rows and bytes are not counted")
+        assert(stats.execution >= 0 and stats.fetch >= 0, "durations are missing")
+        assert(stats.submitted <= stats.dispatched and stats.dispatched <= stats.done, "timestamps out of order")
+
+        local histograms = connection:getStats(true)
+        assert(histograms.queries == 1 and histograms.execution.count == 1, "query was not recorded")
+        assert(connection:getStats().queries == 0, "reset did not clear the histograms")
+        done()
+    end)
+end)
+
+test("live handles are counted and listed with their sql", function(connection, done)
+    local before = odbx.handles().types.query.open
+
+    connection:query("SELECT 'live handle';", function(err, query)
+        if err then return done(err) end
+
+        local live = odbx.handles(0)
+        assert(live.types.query.open == before + 1, "open query is not counted")
+
+        local found = false
+        for _, handle in ipairs(live.long) do
+            if handle.sql == "SELECT 'live handle';" then
+                found = handle.type == "query" and handle.status == "open"
+            end
+        end
+        assert(found, "open query is not listed")
+
+        query:close(function()
+            assert(odbx.handles().types.query.open == before, "closed query is still open")
+            done()
+        end)
+    end)
+end)
+
+test("result cache finds every table a SELECT reads", function(connection, done)
+    local cache = require "odbxuv.cache"
+
+    local function same(list, expected)
+        return table.concat(list, "|") == table.concat(expected, "|")
+    end
+
+    assert(same(cache.readTables("SELECT a, b, c FROM t1 WHERE a = 1"), {"t1"}), "multi column select")
+    assert(same(cache.readTables("SELECT a FROM t1 x, t2 AS y JOIN \"Quoted Name\" q ON q.id = x.id LEFT JOIN `s`.`t4` USING (id)"),
+        {"t1", "t2", "quoted name", "s.t4"}), "joins and quoted names")
+    assert(same(cache.readTables("SELECT a FROM [t5] WHERE b IN (SELECT b FROM t6)"), {"t5", "t6"}), "subquery")
+    assert(cache.writtenTable("INSERT OR REPLACE INTO \"Quoted Name\" VALUES (1)") == "quoted name", "quoted insert")
+    assert(cache.writtenTable("UPDATE t2 SET a = 1") == "t2", "update")
+    assert(cache.writtenTable("DELETE FROM s.t4") == "s.t4", "delete")
+    assert(cache.writtenTable("SELECT 1") == nil, "select writes nothing")
+
+    run(connection, {
+        "DROP TABLE IF EXISTS cache_a;",
+        "DROP TABLE IF EXISTS cache_b;",
+        "CREATE TABLE cache_a (id INTEGER, name TEXT);",
+        "CREATE TABLE cache_b (id INTEGER, note TEXT);",
+        "INSERT INTO cache_a VALUES (1, 'a');",
+        "INSERT INTO cache_b VALUES (1, 'b');"
+    }, function(err)
+        if err then return done(err) end
+
+        local results = odbx.createResultCache({ttl = 60000})
+        connection:setCache(results)
+
+        local sql = "SELECT cache_a.id, name, note FROM cache_a JOIN cache_b ON cache_b.id = cache_a.id;"
+        collect(connection, sql, {cache = true}, function(err, rows)
+            if err then return done(err) end
+
+            collect(connection, sql, {cache = true}, function(err, cached)
+                if err then return done(err) end
+                assert(#cached == 1 and cached[1][3] == "b", "cached rows differ")
+                assert(results:getStats().hits == 1, "second read was not served from the cache")
+
+                -- A write to the joined table drops the entry
+                run(connection, {"INSERT INTO cache_b VALUES (1, 'c');"}, function(err)
+                    if err then return done(err) end
+
+                    collect(connection, sql, {cache = true}, function(err, fresh)
+                        if err then return done(err) end
+                        assert(#fresh == 2, "write to a joined table did not invalidate")
+                        assert(results:getStats().invalidations == 1, "invalidation was not counted")
+                        connection:setCache(nil)
+                        done()
+                    end)
+                end)
+            end)
+        end)
+    end)
+end)
+
+test("prepared statements are reused by sql text and evicted by age", function(connection, done)
+    -- The statement cache is created on first use, with room for two statements here
+    connection.statementCacheSize = 2
+
+    local sqls = {"SELECT ?;", "SELECT ?;", "SELECT ? + 1;", "SELECT ? + 2;", "SELECT ?;"}
+    local i = 0
+    local function step(err, query)
+        if query then query:close() end
+        if err then return done(err) end
+
+        i = i + 1
+        if i > #sqls then
+            local stats = connection:getStatementCacheStats()
+            assert(stats.hits == 1 and stats.misses == 4, "unexpected hits and misses")
+            assert(stats.evictions == 2 and stats.size == 2 and stats.maxSize == 2, "cache is not bounded")
+            return done()
+        end
+        connection:execute(sqls[i], {i}, step)
+    end
+    step()
+end)
+
+test("compiled templates splice their defaults and overrides", function(connection, done)
+    run(connection, {
+        "DROP TABLE IF EXISTS template_rows;",
+        "CREATE TABLE template_rows (id INTEGER, name TEXT);",
+        "INSERT INTO template_rows VALUES (1, 'a'), (2, 'it''s b');"
+    }, function(err)
+        if err then return done(err) end
+
+        local q = createQueryBuilder(connection)
+        q:select("name")
+        q:from("template_rows")
+        q:where("id = :id")
+        q:bind("id", 1)
+        q:compile(function(err, template)
+            if err then return done(err) end
+
+            assert(template:render():find("id = 1", 1, true), "default was not spliced")
+            assert(template:render({id = 2}):find("id = 2", 1, true), "override was not spliced")
+
+            template:execute({id = 2}, function(err, query)
+                if err then return done(err) end
+
+                local names = {}
+                query:on("row", function(name)
+                    names[#names+1] = name
+                end)
+                query:once("fetched", function()
+                    query:close()
+                    assert(#names == 1 and names[1] == "it's b", "template read the wrong row")
+                    done()
+                end)
+                query:fetch()
+            end)
+        end)
+    end)
+end)
+
+test("queued queries time out or are cancelled without breaking the connection", function(connection, done)
+    connection:setMaxInFlight(1)
+
+    local slow = "WITH RECURSIVE seq(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM seq LIMIT 3000000) SELECT COUNT(*) FROM seq;"
+    local codes = {}
+
+    connection:query(slow, function(err, query)
+        if err then return done(err) end
+        assert(not query:cancel(), "cancel of a completed query succeeded")
+        query:close()
+    end)
+
+    connection:query("SELECT 2;", {timeout = 20}, function(err, query)
+        codes.timeout = err and err.code
+    end)
+
+    local cancelled = connection:query("SELECT 3;", function(err, query)
+        codes.cancel = err and err.code
+    end)
+    assert(cancelled:cancel(), "cancel of a queued query failed")
+
+    connection:query("SELECT 4;", function(err, query)
+        if err then return done(err) end
+        query:close()
+
+        assert(codes.timeout == "TIMEOUT", "queued query did not time out")
+        assert(codes.cancel == "CANCELLED", "queued query was not cancelled")
+        done()
+    end)
+end)
+
+test("router sends reads to replicas and writes to the primary", function(connection, done)
+    local router = require "odbxuv.router"
+
+    assert(router.isRead("  -- comment\n/* block */ SELECT 1"), "commented select is a read")
+    assert(router.isRead("WITH x AS (SELECT 1) SELECT * FROM x"), "cte select is a read")
+    assert(not router.isRead("SELECT * FROM t FOR UPDATE"), "locking read is a write")
+    assert(not router.isRead("WITH x AS (SELECT 1) INSERT INTO t SELECT * FROM x"), "cte insert is a write")
+    assert(not router.isRead("INSERT INTO t VALUES (1)"), "insert is a write")
+
+    odbx.createConnection(credentials, function(err, replica)
+        if err then return done(err) end
+
+        local r = odbx.createRouter(connection, {replica}, {ejectTime = 10})
+        r:query("SELECT 1;", function(err, query)
+            if err then return done(err) end
+            query:close()
+
+            r:query("CREATE TABLE IF NOT EXISTS router_rows (id INTEGER);", function(err, query)
+                if err then return done(err) end
+                query:close()
+
+                r:query("SELECT 2;", {route = "write"}, function(err, query)
+                    if err then return done(err) end
+                    query:close()
+
+                    local stats = r:getStats()
+                    assert(stats.replica1.queries == 1, "read did not go to the replica")
+                    assert(stats.primary.queries == 2, "writes did not go to the primary")
+                    assert(stats.primary.outstanding == 0 and stats.replica1.outstanding == 0, "queries are still outstanding")
+
+                    replica:disconnect(function()
+                        replica:close()
+                        done()
+                    end)
+                end)
+            end)
+        end)
+    end)
+end)
+
+test("benchmark helpers run steps in order and count collections", function(connection, done)
+    -- bench/ is not installed along with the tests
+    local ok, common = pcall(require, "../bench/common")
+    if not ok then
+        print("skipped: bench/ not found")
+        return done()
+    end
+
+    local gc = common.gcCounter()
+    collectgarbage()
+    collectgarbage()
+    assert(gc:stop() >= 1, "collections were not counted")
+
+    common.measureAllocation(function(finished)
+        local strings = {}
+        for i = 1, 1000 do
+            strings[i] = "value " .. i
+        end
+        finished()
+    end, function(kilobytes)
+        assert(kilobytes > 0, "allocation was not measured")
+
+        local order = {}
+        common.sequence({
+            function(nextStep)
+                order[#order+1] = 1
+                timer.setTimeout(1, nextStep)
+            end,
+            function(nextStep)
+                order[#order+1] = 2
+                nextStep()
+            end
+        }, function()
+            assert(table.concat(order, ",") == "1,2", "steps ran out of order")
+            done()
+        end)
+    end)
+end)
+
+test("cursors page past integer keys beyond 2^53 without losing rows", function(connection, done)
+    run(connection, {
+        "DROP TABLE IF EXISTS cursor_rows;",
+        "CREATE TABLE cursor_rows (id BIGINT, name TEXT);",
+        "INSERT INTO cursor_rows VALUES (1, 'a'), (2, 'b'), (9007199254740993, 'c'), (9007199254740995, 'd'), (9007199254740997, 'e');"
+    }, function(err)
+        if err then return done(err) end
+
+        local ids = {}
+        connection:cursor("SELECT id, name FROM cursor_rows", {key = "id", pageSize = 2}):each(function(rows, count, next)
+            for i = 1, count do
+                ids[#ids+1] = tostring(rows[i][1])
+            end
+            next()
+        end, function(err)
+            if err then return done(err) end
+            assert(table.concat(ids, ",") == "1,2,9007199254740993,9007199254740995,9007199254740997",
+                "rows were lost or repeated: " .. table.concat(ids, ","))
+            done()
+        end)
+    end)
+end)
+
+test("queries run from native buffers, which are emptied and recycled", function(connection, done)
+    local buffer = native.buffer()
+    native.bufferAppend(buffer, "SELECT ", 1, " + ", 2, ";")
+    assert(native.bufferToString(buffer) == "SELECT 1 + 2;", "appended text is wrong")
+    assert(native.bufferToString(buffer, 6) == "SELECT", "maxLength is not honoured")
+
+    collect(connection, buffer, {}, function(err, rows)
+        if err then return done(err) end
+        assert(rows[1][1] == "3", "buffered query returned the wrong result")
+        assert(native.bufferLength(buffer) == 0, "buffer was not emptied after the query")
+
+        local before = odbx.poolStats().buffer
+        assert(before.free > 0, "buffer memory was not recycled")
+        native.bufferAppend(native.buffer(), "reuse")
+        assert(odbx.poolStats().buffer.hits == before.hits + 1, "spare buffer memory was not reused")
+
+        run(connection, {
+            "DROP TABLE IF EXISTS buffered_rows;",
+            "CREATE TABLE buffered_rows (id INTEGER, name TEXT);"
+        }, function(err)
+            if err then return done(err) end
+
+            local q = createQueryBuilder(connection)
+            q:insert("id", "name")
+            q:into("buffered_rows")
+            for i = 1, 100 do
+                q:values(i, "it's " .. i)
+            end
+            q:query(function(err, query)
+                if query then query:close() end
+                if err then return done(err) end
+
+                collect(connection, "SELECT COUNT(*), MAX(name) FROM buffered_rows;", {}, function(err, rows)
+                    if err then return done(err) end
+                    assert(rows[1][1] == "100" and rows[1][2] == "it's 99", "buffered insert lost rows")
+                    done()
+                end)
+            end)
+        end)
+    end)
+    assert(not pcall(native.bufferAppend, buffer, "x"), "buffer in use by a query was writable")
+end)
+
+test("execute binds positional and named parameters and rejects NaN and infinities", function(connection, done)
+    assert(connection:canBindParams(), "sqlite3 connections bind parameters")
+
+    run(connection, {
+        "DROP TABLE IF EXISTS param_rows;",
+        "CREATE TABLE param_rows (id INTEGER, world TEXT);"
+    }, function(err)
+        if err then return done(err) end
+
+        connection:execute("INSERT INTO param_rows VALUES (?, :world);", {12, world = "it's"}, function(err, q)
+            if q then q:close() end
+            if err then return done(err) end
+
+            for _, value in ipairs({0/0, 1/0, -1/0}) do
+                local ok, message = pcall(connection.execute, connection, "SELECT ?;", {value}, function() end)
+                assert(not ok and message:find("can not be bound"), "non finite number was bound")
+            end
+
+            collect(connection, "SELECT id, world FROM param_rows;", {}, function(err, rows)
+                if err then return done(err) end
+                assert(#rows == 1 and rows[1][1] == "12" and rows[1][2] == "it's", "parameters were not bound")
+                done()
+            end)
+        end)
+    end)
+end)
+
+test("paused queries fail once the held rows exceed the queue limit", function(connection, done)
+    connection:query("WITH RECURSIVE seq(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM seq LIMIT 1000) SELECT x FROM seq;", function(err, query)
+        if err then return done(err) end
+
+        local failed = false
+        query:on("error", function(err)
+            assert(not failed, "error emitted twice")
+            failed = true
+            assert(err.code == "QUEUE_LIMIT", "unexpected error: " .. tostring(err.message))
+            assert(query:getStats().maxQueuedBytes <= 256, "queue grew past its limit")
+
+            -- The rest of the result is dropped without further events
+            timer.setTimeout(50, function()
+                query:close()
+                done()
+            end)
+        end)
+        query:on("fetched", function()
+            done("fetched although the queue limit was hit")
+        end)
+        query:fetch(nil, {highWaterMark = 1, queueLimit = 256})
+    end)
+end)
+
+test("reaping idle pool connections keeps min open", function(connection, done)
+    local pool = odbx.createPool(credentials, {min = 2, max = 4, idleTimeout = 10})
+    local acquired = {}
+
+    for i = 1, 4 do
+        pool:acquire(function(err, connection)
+            if err then return done(err) end
+
+            acquired[#acquired+1] = connection
+            if #acquired < 4 then
+                return
+            end
+
+            for _, c in ipairs(acquired) do
+                pool:release(c)
+            end
+
+            timer.setTimeout(30, function()
+                pool:reapIdle()
+                local stats = pool:getStats()
+                assert(stats.idle == 2, "reaped below min, " .. stats.idle .. " idle left")
+
+                timer.setTimeout(100, function()
+                    local stats = pool:getStats()
+                    assert(stats.size == 2 and stats.destroyed == 2, "unexpected pool size " .. stats.size)
+                    assert(stats.created == 4, "reaped connections were reopened")
+                    pool:close()
+                    done()
+                end)
+            end)
+        end)
+    end
+end)
+
+test("native handles are recycled through the free lists of this state", function(connection, done)
+    local function createHandles(n)
+        for i = 1, n do
+            odbx.Connection:new()
+        end
+        collectgarbage()
+        collectgarbage()
+    end
+
+    createHandles(10)
+    local before = odbx.poolStats().connection
+    assert(before.free >= 10, "collected handles were not given back to the free list")
+
+    createHandles(10)
+    local after = odbx.poolStats().connection
+    assert(after.hits - before.hits == 10, "handles were not reused")
+    assert(after.inUse == before.inUse, "handles are still counted in use")
+    done()
+end)
+
+test("handles collected without being closed are counted as leaked", function(connection, done)
+    local before = odbx.handles()
+
+    for i = 1, 3 do
+        odbx.Connection:new()
+    end
+    assert(odbx.handles().count >= before.count + 3, "new handles are not counted")
+
+    collectgarbage()
+    collectgarbage()
+    local after = odbx.handles()
+    assert(after.leaked == before.leaked + 3, "leaked handles were not counted")
+    assert(after.count <= before.count, "collected handles are still listed")
+    done()
+end)
+
+test("bulkInsert failures reach finish without an error listener", function(connection, done)
+    local writer = connection:bulkInsert("bulk_missing_table", {"id"}, {batchSize = 2})
+    for i = 1, 3 do
+        writer:write({i})
+    end
+
+    -- The first chunk fails before finish is called, nothing listens for "error" yet
+    timer.setTimeout(50, function()
+        assert(writer.failed, "insert into a missing table did not fail")
+        assert(writer:write({4}) == false, "write after a failure was accepted")
+
+        local calls = 0
+        writer:finish(function(err)
+            calls = calls + 1
+            assert(err, "finish did not report the failure")
+        end)
+
+        timer.setTimeout(50, function()
+            assert(calls == 1, "finish called back " .. calls .. " times")
+            done()
+        end)
+    end)
+end)
+
+test("fetchColumnar keeps integers beyond 2^53 exact", function(connection, done)
+    run(connection, {
+        "DROP TABLE IF EXISTS columnar_big;",
+        "CREATE TABLE columnar_big (big BIGINT);",
+        "INSERT INTO columnar_big VALUES (9007199254740993), (-9007199254740995), (7);"
+    }, function(err)
+        if err then return done(err) end
+
+        connection:query("SELECT big FROM columnar_big;", function(err, query)
+            if err then return done(err) end
+
+            query:fetchColumnar(function(columns)
+                query:close()
+
+                assert(columns:get(1, 0) == "9007199254740993", "big integer lost precision")
+                assert(columns:get(1, 1) == "-9007199254740995", "negative big integer lost precision")
+                assert(columns:get(1, 2) == 7, "small integer is not a number")
+                assert(columns:sum(1) == 5, "sum is wrong")
+                done()
+            end)
+        end)
+    end)
+end)
+
+test("failed buffered queries keep their sql for a retry", function(connection, done)
+    local sql = "SELECT COUNT(*) FROM retry_rows;"
+    local buffer = native.buffer()
+    native.bufferAppend(buffer, sql)
+
+    run(connection, {"DROP TABLE IF EXISTS retry_rows;"}, function(err)
+        if err then return done(err) end
+
+        collect(connection, buffer, {}, function(err)
+            assert(err, "query on a missing table did not fail")
+            assert(native.bufferToString(buffer) == sql, "failed query emptied the buffer")
+
+            run(connection, {"CREATE TABLE retry_rows (id INTEGER);"}, function(err)
+                if err then return done(err) end
+
+                collect(connection, buffer, {}, function(err, rows)
+                    if err then return done(err) end
+                    assert(rows[1][1] == "0", "retried query returned the wrong result")
+                    assert(native.bufferLength(buffer) == 0, "buffer was not emptied after the query")
+                    done()
+                end)
+            end)
+        end)
+    end)
+end)
+
+test("buffered QueryBuilder sql matches the string sql", function(connection, done)
+    local function build(buffered)
+        local q = createQueryBuilder(connection)
+        q:update("servers")
+        q:set({world = "it's"})
+        q:where("id = :id")
+        q:bind("id", 12)
+        if buffered then
+            q:buffered()
+        end
+        return q
+    end
+
+    build(false):finalize(function(err, sql)
+        if err then return done(err) end
+
+        build(true):finalize(function(err, buffer)
+            if err then return done(err) end
+            assert(type(buffer) == "userdata", "buffered finalize did not hand out a buffer")
+            assert(native.bufferToString(buffer) == sql, "buffered sql differs: " .. native.bufferToString(buffer))
+            done()
+        end)
+    end)
+end)
+
+test("router gives pooled connections back once results are read or fail", function(connection, done)
+    local pool = odbx.createPool(credentials, {max = 1})
+    local r = odbx.createRouter(connection, {pool})
+    local open = {}
+
+    r:query("SELECT 1;", function(err, query)
+        if err then return done(err) end
+        open[#open+1] = query
+
+        query:once("fetched", function()
+            -- The query stays open, its connection is back in the pool anyway
+            assert(pool:getStats().inUse == 0, "connection was kept until close")
+
+            r:query("SELECT * FROM router_missing_table;", function(err, query)
+                assert(err, "query on a missing table did not fail")
+                open[#open+1] = query
+                assert(pool:getStats().inUse == 0, "connection of a failed query was kept")
+
+                r:query("SELECT 2;", function(err, query)
+                    if err then return done(err) end
+                    query:close()
+
+                    for _, q in ipairs(open) do
+                        q:close()
+                    end
+                    pool:close()
+                    done()
+                end)
+            end)
+        end)
+        query:fetch()
+    end)
+end)